@@ -1,9 +1,9 @@
 #!/usr/bin/env lua
 
-local parse, null
+local parse, columns, null
 do
    local M = require 'voorhees'
-   parse, null = M.parse, M.null
+   parse, columns, null = M.parse, M.columns, M.null
 end
 
 local function dump_result(header, r, msg)
@@ -93,6 +93,148 @@ for k, v in pairs(tests) do
    dump_result(k, parse(v, 'utf8', 20))
 end
 
+dump_result('columns', columns([[
+[{ "ts" : 1, "host" : "a", "value" : 0.5 }, { "ts" : 2, "host" : "b" }]
+]], ''))
+dump_result('columns of an object', columns('{ "a" : { "ts" : 1 } }', '/a'))
+
+dump_result('packed', parse('[[1, 2.5, -3e2], [4, "mixed"]]', { packed = true }))
+
+do
+   local cached = require 'voorhees'.cache{ entries = 2 }
+   local text = '{ "key" : "string" }'
+   local first = cached(text)
+   first.key = 'changed'
+   dump_result('cached', cached(text))
+   local sentinel = {}
+   local keep = require 'voorhees'.cache{ null = sentinel }
+   keep('[null]')
+   print('cached null', keep('[null]')[1] == sentinel)
+   print ''
+end
+
+do
+   local out = {}
+   print('transcode', require 'voorhees'.transcode(
+      '[ "caf\\u00e9\\/", { "k" : [ 1.5e3, true, null ] } ]',
+      function(chunk) out[#out + 1] = chunk end, { minify = true }))
+   print(table.concat(out))
+   print ''
+end
+
+do
+   local M = require 'voorhees'
+   local shared = M.freeze({ 'frozen', { x = 1 } })
+   print(M.encode({ 1, 2.5, 'a"b\n', true, M.null, {}, shared }))
+   print(M.encode({ s = 'h\195\169' }, { ascii = true }))
+   print(M.encode(shared) == M.encode(shared), select(2, M.freeze(shared, true)))
+   print ''
+end
+
+dump_result('max_elements', parse('[1, 2, 3, 4]', { max_elements = 3 }))
+dump_result('max_bytes', parse('[1, 2, 3, 4]', { max_bytes = 6 }))
+dump_result('max_string', parse('["abc", "abcdef"]', { max_string = 4 }))
+do
+   local big = '[' .. string.rep('"x", ', 10000) .. '"x"]'
+   dump_result('max_memory', parse('[1, 2, 3]', { max_memory = 64 * 1024 }))
+   dump_result('max_memory exceeded', parse(big, { max_memory = 16 * 1024 }))
+   print('after max_memory', #parse(big))
+   print ''
+end
+do
+   local opts = { max_keys = 1 }
+   local decode = require 'voorhees'.decoder(opts)
+   opts.max_keys = 10
+   dump_result('decoder', decode('{ "a" : 1, "b" : 2 }'))
+end
+
+do
+   local decode = require 'voorhees'.compile_schema{
+      id = 'integer', tags = { 'string' }, data = 'base64',
+   }
+   dump_result('schema', decode('{ "id" : 1, "tags" : ["a"], "x" : [{}], "data" : "aGk=" }'))
+   dump_result('schema fallback', decode('{ "id" : 1.5 }'))
+   dump_result('schema overlong', decode('{ "tags" : ["\192\128"] }'))
+end
+
+do
+   local calls = 0
+   dump_result('progress', parse('[' .. string.rep('1, ', 100) .. '1]', {
+      gc_step = 0, gc_interval = 10,
+      progress = function() calls = calls + 1 end, progress_interval = 100,
+   }))
+   print('progress calls', calls)
+   calls = 0
+   parse('\239\187\191[1, 2]', {
+      progress = function() calls = calls + 1 end, progress_interval = math.huge,
+   })
+   print('progress calls never', calls)
+   print ''
+end
+
+dump_result('base64', parse('{ "a" : "aGVsbG8=", "b" : ["d29y", "bGQ\\/"] }',
+   { base64 = { '/a', '/b/*' } }))
+dump_result('base64 error', parse('{ "a" : "aGVsbG8" }', { base64 = '/a' }))
+
+do
+   local sunk = {}
+   dump_result('string_sink', parse('{ "blob" : ["'..string.rep('x', 100)..'"] }', {
+      string_threshold = 10,
+      string_sink = function(path, chunk, last)
+         sunk[#sunk + 1] = path..' '..#chunk..' '..tostring(last)
+      end,
+   }).blob)
+   print(table.concat(sunk, '\n'))
+   print ''
+end
+
+do
+   local M = require 'voorhees'
+   local name = os.tmpname()
+   print('compile', M.compile('{ "key" : [1, "two", null], "e" : {} }', name))
+   dump_result('load', M.load(name))
+   os.remove(name)
+end
+
+do
+   local data = {}
+   local parse_into = require 'voorhees'.parse_into
+   parse_into(data, '{ "old" : 1, "list" : [1, 2, 3], "sub" : { "a" : 1 } }')
+   local sub = data.sub
+   parse_into(data, '{ "list" : [4], "sub" : { "b" : 2 } }')
+   dump_result('parse_into', data)
+   print('reused '..tostring(data.sub == sub), #data.list, data.sub.a)
+   print ''
+end
+
+do
+   local file = io.open('test/pass02.json')
+   dump_result('parsefd', require 'voorhees'.parsefd(file))
+   file:close()
+end
+
+do
+   local ids = {}
+   local n = require 'voorhees'.each([[
+{ "statuses" : [{ "id" : 1 }, { "id" : 2 }, { "id" : 3 }] }
+]], '/statuses/*', function(status) ids[#ids + 1] = status.id end)
+   dump_result('each', ids)
+   print('each found '..n)
+end
+
+if jit then
+   local tape = require 'voorhees.tape'
+   local ffi = require 'ffi'
+   local text = tests['string']
+   local buffer = ffi.new('char[?]', #text, text)
+
+   dump_result('cdata', parse(buffer, #text))
+
+   for k, v in pairs(tests) do
+      dump_result('tape '..k, tape.decode(v, 20))
+   end
+end
+
 print('null = '..tostring(null))
 print('null() = '..tostring(null()))
 
@@ -12,10 +12,10 @@ curl 'http://<user>:<pass>@twitter.com/statuses/friends_timeline.json' \
    | ./twitprint.lua
 --]]
 
-local parse
+local parsefd
 do
    local M = require 'voorhees'
-   parse = M.parse
+   parsefd = M.parsefd
 end
 
 local format = string.format
@@ -98,7 +98,7 @@ do
       file = io.stdin
    end
 
-   data, err = parse(function() return file:read(1024) end, 'utf8', 5)
+   data, err = parsefd(file, 'utf8', 5)
    if not data then
       print('Error parsing JSON file: '..err)
       os.exit(1)
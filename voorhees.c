@@ -26,15 +26,35 @@
  * Same restrictions apply.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
 #include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #define LUA_LIB
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "voorhees.h"
+
 #define DEFAULT_DEPTH 20
 #define STRBUF_SIZE 1024
+#define SINK_PARTS 64
+#define DEFAULT_THRESHOLD (SINK_PARTS * STRBUF_SIZE)
+#define READER_BUFFERS 3
+#define READER_SIZE (256 * 1024)
+#define DEFAULT_GC_INTERVAL (64 * 1024)
+#define DEFAULT_PROGRESS_INTERVAL (1024 * 1024)
 
 #define __   -1 /* universal error code */
 
@@ -225,6 +245,27 @@ struct input {
 	size_t len;
 	size_t read;
 	int string_index;
+	struct reader *reader;
+	/* Number of bytes allowed to be read, and set
+	 * if the input was cut short at that limit */
+	size_t limit;
+	int truncated;
+	/* Position of the next checkpoint or 0, and the number of
+	 * bytes of the current chunk held back until it is reached */
+	size_t checkpoint;
+	size_t held;
+	/* Size of the garbage collector steps or -1, bytes between
+	 * them and whether the collector is stopped meanwhile */
+	int gc_step;
+	size_t gc_interval;
+	size_t next_gc;
+	int gc_stopped;
+	/* Stack index of the progress function or 0, and bytes
+	 * between calls. failed is set if it raised an error */
+	int progress_index;
+	size_t progress_interval;
+	size_t next_progress;
+	int failed;
 };
 
 /*
@@ -237,12 +278,254 @@ struct strbuf {
 	char base[STRBUF_SIZE];
 };
 
+/*
+ * Ring of buffers filled from a file descriptor by a background
+ * thread while the parser reads the previous ones.
+ *
+ * The thread is the only one to write head and the parser the only
+ * one to write tail, but both are read and written with the mutex
+ * held. It is taken once per buffer, and the condition variables
+ * wake up the other side when the ring was empty or full
+ */
+#define READER_MT "voorhees.reader"
+
+struct reader {
+	int fd;
+	/* Number of buffers filled by the thread */
+	unsigned int head;
+	/* Number of buffers released by the parser */
+	unsigned int tail;
+	int stop;
+	/* errno of a failed read */
+	int error;
+	int running;
+	int busy;
+	int eof;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t freed;
+	size_t len[READER_BUFFERS];
+	unsigned char buf[READER_BUFFERS][READER_SIZE];
+};
+
+static void *reader_thread(void *arg)
+{
+	struct reader *r = arg;
+	unsigned int head = 0;
+	int stop;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;) {
+		unsigned char *buf = r->buf[head % READER_BUFFERS];
+		size_t len = 0;
+		ssize_t ret;
+
+		/* Wait for the parser to release a buffer */
+		pthread_mutex_lock(&r->lock);
+		while (head - r->tail == READER_BUFFERS && !r->stop)
+			pthread_cond_wait(&r->freed, &r->lock);
+		stop = r->stop;
+		pthread_mutex_unlock(&r->lock);
+		if (stop)
+			break;
+
+		/* Pipes and sockets return what is available, but make
+		 * sure the first buffer is long enough to detect
+		 * the encoding if possible */
+		do {
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			ret = read(r->fd, buf + len, READER_SIZE - len);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				r->error = errno;
+				break;
+			}
+			len += ret;
+		} while (ret > 0 && head == 0 && len < 4);
+
+		pthread_mutex_lock(&r->lock);
+		r->len[head % READER_BUFFERS] = len;
+		r->head = ++head;
+		pthread_cond_signal(&r->filled);
+		pthread_mutex_unlock(&r->lock);
+
+		/* An empty buffer marks the end of the input */
+		if (len == 0)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Releases the buffer the parser is done with
+ * and waits for the next one
+ */
+static int reader_getchunk(struct reader *r, struct input *in)
+{
+	unsigned int tail = r->tail;
+
+	if (r->eof)
+		return 1;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->busy) {
+		r->tail = ++tail;
+		pthread_cond_signal(&r->freed);
+	}
+	while (r->head == tail)
+		pthread_cond_wait(&r->filled, &r->lock);
+	in->len = r->len[tail % READER_BUFFERS];
+	pthread_mutex_unlock(&r->lock);
+
+	r->busy = 1;
+	in->p = r->buf[tail % READER_BUFFERS];
+	if (in->len == 0) {
+		r->eof = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stops the thread if it is still running. It may be waiting for
+ * a free buffer or blocked reading more than the document from
+ * a pipe or socket which is kept open
+ */
+static void reader_stop(struct reader *r)
+{
+	if (!r->running)
+		return;
+
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_signal(&r->freed);
+	pthread_mutex_unlock(&r->lock);
+
+	pthread_cancel(r->thread);
+	pthread_join(r->thread, NULL);
+	r->running = 0;
+}
+
+static int reader_gc(lua_State *L)
+{
+	struct reader *r = lua_touserdata(L, 1);
+
+	reader_stop(r);
+	pthread_cond_destroy(&r->freed);
+	pthread_cond_destroy(&r->filled);
+	pthread_mutex_destroy(&r->lock);
+	return 0;
+}
+
+/*
+ * This function cuts the current chunk short if it goes past
+ * the limit of the input, and holds back the rest of it after
+ * the next checkpoint. Returns 1 if nothing is left of it
+ */
+static int limit_chunk(struct input *in)
+{
+	if (in->len > in->limit - in->read) {
+		in->len = in->limit - in->read;
+		in->truncated = 1;
+	}
+	if (in->checkpoint && in->len > in->checkpoint - in->read) {
+		in->held = in->len - (in->checkpoint - in->read);
+		in->len -= in->held;
+	}
+	return in->len == 0;
+}
+
+/*
+ * This function returns the position interval bytes after read,
+ * or the largest position if that's too far
+ */
+static size_t after_interval(size_t read, size_t interval)
+{
+	return interval > (size_t)-1 - read ? (size_t)-1 : read + interval;
+}
+
+static void set_checkpoint(struct input *in)
+{
+	in->checkpoint = 0;
+	if (in->gc_step >= 0) {
+		in->checkpoint = in->next_gc;
+	}
+	if (in->progress_index && (in->checkpoint == 0 ||
+				in->next_progress < in->checkpoint)) {
+		in->checkpoint = in->next_progress;
+	}
+}
+
+/*
+ * This function is called before reading the first chunk
+ */
+static void start_input(struct input *in)
+{
+	in->held = 0;
+	in->next_gc = after_interval(in->read, in->gc_interval);
+	in->next_progress = after_interval(in->read, in->progress_interval);
+	set_checkpoint(in);
+	limit_chunk(in);
+}
+
+/*
+ * This function is called when the parser reaches a checkpoint.
+ * It steps the garbage collector and calls the progress function
+ * when they're due. Returns 1 with the error message in place of
+ * the progress function if that raised an error
+ */
+static int run_checkpoint(lua_State *L, struct input *in)
+{
+	if (in->gc_step >= 0 && in->read >= in->next_gc) {
+		lua_gc(L, LUA_GCSTEP, in->gc_step);
+		/* On some versions a step restarts the collector */
+		if (in->gc_stopped) {
+			lua_gc(L, LUA_GCSTOP, 0);
+		}
+		in->next_gc = after_interval(in->read, in->gc_interval);
+	}
+
+	if (in->progress_index && in->read >= in->next_progress) {
+		lua_pushvalue(L, in->progress_index);
+		lua_pushnumber(L, (lua_Number)in->read);
+		if (lua_pcall(L, 1, 0, 0)) {
+			lua_replace(L, in->progress_index);
+			in->failed = 1;
+			return 1;
+		}
+		in->next_progress = after_interval(in->read,
+				in->progress_interval);
+	}
+
+	set_checkpoint(in);
+	return 0;
+}
+
 /*
  * Runs the Lua generator function to get another chunk
  * of the JSON document if one is provided
  */
 static int getchunk(lua_State *L, struct input *in)
 {
+	if (in->checkpoint && in->read >= in->checkpoint &&
+			run_checkpoint(L, in))
+		return 1;
+
+	if (in->held) {
+		in->len = in->held;
+		in->held = 0;
+		return limit_chunk(in);
+	}
+
+	if (in->reader != NULL)
+		return reader_getchunk(in->reader, in) || limit_chunk(in);
+
 	if (in->string_index == 0)
 		return 1;
 
@@ -258,7 +541,7 @@ static int getchunk(lua_State *L, struct input *in)
 	if (in->p == NULL || in->len == 0)
 		return 1;
 
-	return 0;
+	return limit_chunk(in);
 }
 
 /*
@@ -380,13 +663,14 @@ static int utf16le_getchar(lua_State *L, struct input *in)
 		}
 		c |= (*in->p++ << 8);
 		in->len--;
+		in->read += 2;
 
 		if (c < 0xDC00 || c >= 0xE000) {
 			return -1;
 		}
 
 		c &= 1023;
-		c |= (high_sur & 1023) << 16;
+		c |= (high_sur & 1023) << 10;
 		c |= 0x10000;
 	}
 
@@ -435,19 +719,93 @@ static int utf16be_getchar(lua_State *L, struct input *in)
 		}
 		c |= *in->p++;
 		in->len--;
+		in->read += 2;
 
 		if (c < 0xDC00 || c >= 0xE000) {
 			return -1;
 		}
 
 		c &= 1023;
-		c |= (high_sur & 1023) << 16;
+		c |= (high_sur & 1023) << 10;
 		c |= 0x10000;
 	}
 
 	return c;
 }
 
+/*
+ * Values of hex digits and 16 for all other bytes
+ */
+static const unsigned char hex_value[256] = {
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,16,16,16,16,16,16,
+	16,10,11,12,13,14,15,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,10,11,12,13,14,15,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+	16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16
+};
+
+/*
+ * Decodes the 4 hex digits at p or returns -1 if they aren't
+ */
+static int hex4(const unsigned char *p)
+{
+	if ((hex_value[p[0]] | hex_value[p[1]] |
+				hex_value[p[2]] | hex_value[p[3]]) & 16)
+		return -1;
+
+	return hex_value[p[0]] << 12 | hex_value[p[1]] << 8 |
+		hex_value[p[2]] << 4 | hex_value[p[3]];
+}
+
+/*
+ * This function is called after reading \u from UTF-8 encoded input.
+ * If the 4 hex digits, and the escaped low surrogate following a high
+ * surrogate, are all in the current chunk they're decoded in one go.
+ * Returns the code point, or -1 without reading anything if the escape
+ * must be read character by character by the automaton
+ */
+static int fast_unicode(struct input *in)
+{
+	int c;
+	int low;
+	size_t n = 4;
+
+	if (in->len < 4)
+		return -1;
+
+	c = hex4(in->p);
+	if (c < 0 || (c >= 0xDC00 && c < 0xE000))
+		return -1;
+
+	if (c >= 0xD800 && c < 0xDC00) {
+		if (in->len < 10 || in->p[4] != '\\' || in->p[5] != 'u')
+			return -1;
+
+		low = hex4(in->p + 6);
+		if (low < 0xDC00 || low >= 0xE000)
+			return -1;
+
+		c = 0x10000 | (c & 1023) << 10 | (low & 1023);
+		n = 10;
+	}
+
+	in->p += n;
+	in->len -= n;
+	in->read += n;
+	return c;
+}
+
 /*
  * This function is responsible for detecting the encoding
  * of the input and return the right getchar function
@@ -539,7 +897,7 @@ static void utf16le_putchar (struct strbuf *s, int c)
 		*s->p++ = (char)(c >> 8);
 		s->written += 2;
 	} else {
-		c &= 0x10000;
+		c -= 0x10000;
 		*s->p++ = (char)((c >> 10) & 255);
 		*s->p++ = (char)(0xD8 | ((c >> 18) & 3));
 		*s->p++ = (char)(c & 255);
@@ -565,475 +923,5594 @@ static void latin1_putchar(struct strbuf *s, int c)
 }
 
 /*
- * This macro pushes the contents of the string buffer
- * to the Lua stack. All the pieces will be
- * lua_concat()'ed in the end.
+ * Lookup table to get the value of a base64 character,
+ * or 64 for characters not in the alphabet
  */
-#define flush_buffer() \
-	luaL_checkstack(L, 1, "out of memory"); \
-	lua_pushlstring(L, s.base, s.written); \
-	r++; \
-	s.parts++; \
-	s.written = 0; \
-	s.p = s.base
+static const unsigned char base64_value[256] = {
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,62,64,64,64,63,
+	52,53,54,55,56,57,58,59,60,61,64,64,64,64,64,64,
+	64, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,
+	15,16,17,18,19,20,21,22,23,24,25,64,64,64,64,64,
+	64,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+	41,42,43,44,45,46,47,48,49,50,51,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,
+	64,64,64,64,64,64,64,64,64,64,64,64,64,64,64,64
+};
 
 /*
- * This is the parse function exported to Lua
- *
- * The first part reads the arguments provided
- * and initialises the input, string buffer
- * and putchar and getchar functions accordingly
- *
- * The middle loop reads a character from the input
- * and looks up the next state or action in the state
- * table and performs the corresponding actions
- * until the JSON document is finished or a
- * syntax or encoding error occurs
+ * This function adds the base64 character c to the bits read so far
+ * and writes the decoded bytes to the string buffer. n is the number
+ * of characters read in the current group of 4, 5 when a second '='
+ * must follow and 8 when the padding is complete.
  *
- * The last part checks if everything went alright,
- * frees the stack and returns the parsed array
- * or object table
+ * Returns -1 if c isn't allowed here
  */
-static int l_parse(lua_State *L)
+static int base64_putchar(struct strbuf *s, unsigned long *bits,
+		int *n, int c)
 {
-	struct input in;
-	struct strbuf s;
-	int next_char;
-	signed char *stack;
-	unsigned int top = 0;
-	unsigned int depth = DEFAULT_DEPTH;
-	signed char state = GO;
-	int null_index = lua_upvalueindex(1);
-	int high_sur = 0;
-	int unicode = 0;
-	int r = 0;
-	putchar_func putchar = utf8_putchar;
-	getchar_func getchar;
-	int nargs = lua_gettop(L);
+	if (c == '=') {
+		switch (*n) {
+		case 2:
+			*s->p++ = (char)(*bits >> 4);
+			s->written++;
+			*n = 5;
+			return 0;
+		case 3:
+			*s->p++ = (char)(*bits >> 10);
+			*s->p++ = (char)(*bits >> 2);
+			s->written += 2;
+			*n = 8;
+			return 0;
+		case 5:
+			*n = 8;
+			return 0;
+		}
+		return -1;
+	}
 
-	/*
-	 * Part 1: Read Lua arguments and initialise
-	 * variables
-	 */
-	if (nargs < 1) {
-		return luaL_error(L, "too few arguments");
+	if (c > 255 || base64_value[c] == 64 || *n > 3)
+		return -1;
+
+	*bits = *bits << 6 | base64_value[c];
+	if (++*n == 4) {
+		s->p[0] = (char)(*bits >> 16);
+		s->p[1] = (char)(*bits >> 8);
+		s->p[2] = (char)*bits;
+		s->p += 3;
+		s->written += 3;
+		*bits = 0;
+		*n = 0;
 	}
+	return 0;
+}
 
-	in.read = 0;
-	switch (lua_type(L, 1)) {
-	case LUA_TSTRING:
-		in.p = (unsigned char *)lua_tolstring(L, 1, &in.len);
-		if (in.p == NULL || in.len < 2) {
-			lua_pushnil(L);
-			lua_pushliteral(L, "string too short");
-			return 2;
-		}
-		in.string_index = 0;
-		break;
-	case LUA_TFUNCTION:
-		lua_pushvalue(L, 1);
-		if (lua_pcall(L, 0, 1, 0)) {
-			lua_pushnil(L);
-			lua_insert(L, -2);
-			return 2;
-		}
+/*
+ * This function decodes whole groups of 4 base64 characters directly
+ * from UTF-8 encoded input into the string buffer, until the buffer is
+ * full or something else than 4 characters of the alphabet follows.
+ * Returns 1 if it stopped because the buffer is full
+ */
+static int base64_fast(struct input *in, struct strbuf *s)
+{
+	const unsigned char *p = in->p;
+	const unsigned char *end = p + (in->len & ~(size_t)3);
+	char *out = s->p;
+	char *full = s->base + (STRBUF_SIZE - 4);
 
-		in.p = (unsigned char *)lua_tolstring(L, -1, &in.len);
-		if (in.p == NULL || in.len == 0) {
-			lua_pushnil(L);
-			lua_pushliteral(L, "string too short");
-			return 2;
-		}
+	while (p < end && out < full) {
+		unsigned long v;
 
-		in.string_index = lua_gettop(L);
+		if ((base64_value[p[0]] | base64_value[p[1]] |
+					base64_value[p[2]] | base64_value[p[3]]) & 64)
+			break;
 
-		/* Make sure the first chunk is at least 4
-		 * characters long if possible */
-		while (in.len < 4) {
-			lua_pushvalue(L, 1);
-			if (lua_pcall(L, 0, 1, 0) ||
-					!lua_isstring(L, -1)) {
-				in.string_index = 0;
-				lua_pop(L, 1);
-				break;
-			}
-			/* Even if the user is silly enough to pass only
-			 * 1 byte at a time we'll only concat strings
-			 * 3 times in this loop */
-			lua_concat(L, 2);
-			in.p = (unsigned char *)lua_tolstring(L, -1, &in.len);
-		}
-		break;
-	default:
-		return luaL_argerror(L, 1, "expected string or function");
+		v = (unsigned long)base64_value[p[0]] << 18 |
+			(unsigned long)base64_value[p[1]] << 12 |
+			(unsigned long)base64_value[p[2]] << 6 |
+			base64_value[p[3]];
+		out[0] = (char)(v >> 16);
+		out[1] = (char)(v >> 8);
+		out[2] = (char)v;
+		out += 3;
+		p += 4;
 	}
 
-	getchar = detect_encoding(&in);
-	
-	if (nargs >= 2) {
-		const char *str = lua_tostring(L, 2);
-		if (str == NULL) {
-			return luaL_argerror(L, 2,
-					"encoding must be a string");
-		}
-		if (strcasecmp(str, "utf8") == 0) {
-			putchar = utf8_putchar;
-		} else if (strcasecmp(str, "utf16") == 0 ||
-				strcasecmp(str, "utf16le") == 0) {
-			putchar = utf16le_putchar;
-		} else if (strcasecmp(str, "latin1") == 0) {
-			putchar = latin1_putchar;
-		} else {
-			return luaL_error(L,
-					"bad argument #2 "
-					"(unknown encoding '%s')",
-					str);
-		}
-	}
+	in->len -= p - in->p;
+	in->read += p - in->p;
+	in->p = p;
+	s->written += out - s->p;
+	s->p = out;
+	return out >= full;
+}
 
-	if (nargs >= 3) {
-		depth = (int)lua_tonumber(L, 3);
-		if (depth < 1) {
-			return luaL_argerror(L, 3, "depth must be 1 or greater");
-		}
-	}
+/*
+ * One step of a compiled path
+ */
+struct segment {
+	const char *p;
+	size_t len;
+	long index;
+	int any;
+};
 
-	/* Expand the Lua stack size so we have room enough to parse
-	 * the JSON documents of maximum depth */
-	luaL_checkstack(L, depth + 1, "out of memory");
+/*
+ * A JSON pointer like "/statuses/0" compiled by compile_path().
+ * As an extension a "*" step matches any key or index
+ */
+struct path {
+	unsigned int n;
+	/* Number of open containers on the path */
+	unsigned int deep;
+	struct segment seg[1];
+};
 
-	/* Allocate memory form the stack */
-	stack = malloc(depth);
-	if (stack == NULL) {
-		return luaL_error(L, "out of memory");
-	}
-	stack[0] = MODE_DONE;
+/*
+ * This function compiles the JSON pointer at index idx and
+ * pushes the result as a userdata. Returns NULL if the
+ * value isn't a valid JSON pointer
+ */
+static struct path *compile_path(lua_State *L, int idx)
+{
+	struct path *path;
+	struct segment *seg;
+	const char *str;
+	const char *end;
+	char *names;
+	unsigned int n = 0;
+	size_t len;
+	size_t i;
 
-	if (nargs >= 4)
-		null_index = 4;
+	if (lua_type(L, idx) != LUA_TSTRING)
+		return NULL;
 
-	/* Initialise the string buffer */
-	s.parts = 0;
-	s.written = 0;
-	s.p = s.base;
+	str = lua_tolstring(L, idx, &len);
+	if (len > 0 && str[0] != '/')
+		return NULL;
 
+	for (i = 0; i < len; i++) {
+		if (str[i] == '/')
+			n++;
+	}
 
-	/*
-	 * Part 2: The parsing loop
-	 */
-	while ((next_char = getchar(L, &in)) > 0) {
-		signed char next_class;
-		
-		/* Determine the character's class. */
-		if (next_char >= 126) {
-			next_class = C_ETC;
-		} else {
-			next_class = ascii_class[next_char];
-			if (next_class <= __) {
-				goto syntax_error;
+	path = lua_newuserdata(L, sizeof(struct path) +
+			n * sizeof(struct segment) + len);
+	path->n = n;
+	path->deep = 0;
+	names = (char *)(path->seg + n + 1);
+
+	end = str + len;
+	for (seg = path->seg; str < end; seg++) {
+		/* Skip the '/' */
+		str++;
+
+		seg->p = names;
+		while (str < end && *str != '/') {
+			if (*str == '~') {
+				str++;
+				if (str == end) {
+					return NULL;
+				}
+				switch (*str) {
+				case '0':
+					*names++ = '~';
+					break;
+				case '1':
+					*names++ = '/';
+					break;
+				default:
+					return NULL;
+				}
+			} else {
+				*names++ = *str;
 			}
+			str++;
 		}
+		seg->len = names - seg->p;
+		seg->any = (seg->len == 1 && seg->p[0] == '*');
 
-again:
-		/* Get the next state/action from the state transition table */
-		state = state_transition_table[state][next_class];
+		/* Array indices are written without leading zeros */
+		seg->index = -1;
+		if (seg->len > 0 && seg->len < 10 &&
+				(seg->p[0] != '0' || seg->len == 1)) {
+			long index = 0;
 
-		/* Perform actions according to the state/action */
-		switch (state) {
-		case N1:
-			lua_pushvalue(L, null_index);
+			for (i = 0; i < seg->len; i++) {
+				if (seg->p[i] < '0' || seg->p[i] > '9')
+					break;
+				index = 10 * index + (seg->p[i] - '0');
+			}
+			if (i == seg->len)
+				seg->index = index;
+		}
+	}
+
+	return path;
+}
+
+/*
+ * This function checks if the value about to be stored in the
+ * container at level top is on the path. The key of the value
+ * is at stack index key if the container is an object, and
+ * index is the number of elements before it if it's an array.
+ *
+ * Returns 2 if the value is on the path, 1 if it is at
+ * the end of the path and 0 otherwise
+ */
+static int path_step(lua_State *L, const struct path *path,
+		unsigned int top, signed char mode,
+		unsigned int index, int key)
+{
+	if (path->deep != top)
+		return 0;
+
+	if (top > 0) {
+		const struct segment *seg = &path->seg[top - 1];
+
+		if (seg->any) {
+			/* matches anything */
+		} else if (mode == MODE_ARRAY) {
+			if (seg->index != (long)index)
+				return 0;
+		} else {
+			size_t len;
+			const char *str = lua_tolstring(L, key, &len);
+
+			if (len != seg->len || memcmp(str, seg->p, len))
+				return 0;
+		}
+	}
+
+	return top == path->n ? 1 : 2;
+}
+
+/*
+ * This function checks if the value being read in the container at
+ * level top is at the end of the path. Unlike path_step() the whole
+ * path is compared every time, using the keys on the Lua stack above
+ * base, so any number of paths can be checked at the same time
+ */
+static int path_match(lua_State *L, const struct path *path,
+		const signed char *stack, const unsigned int *count,
+		unsigned int top, int base)
+{
+	unsigned int level;
+	int idx = base;
+
+	if (path->n != top)
+		return 0;
+
+	for (level = 1; level <= top; level++) {
+		const struct segment *seg = &path->seg[level - 1];
+
+		idx++;
+		if (stack[level] == MODE_ARRAY) {
+			if (!seg->any && seg->index != (long)count[level])
+				return 0;
+		} else {
+			idx++;
+			if (!seg->any) {
+				size_t len;
+				const char *str = lua_tolstring(L, idx, &len);
+
+				if (len != seg->len || memcmp(str, seg->p, len))
+					return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * The parser state besides the state of the automaton
+ */
+struct parser {
+	struct input in;
+	getchar_func getchar;
+	putchar_func putchar;
+	unsigned int depth;
+	int null_index;
+
+	/* Path of the array to decode into columns */
+	struct path *path;
+	/* Level of the array decoded into columns or 0 */
+	unsigned int columns;
+	/* Stack index of the table of columns */
+	int columns_index;
+	/* Set when a row ended since the last comma */
+	int row;
+
+	/* Decode arrays of numbers into vectors */
+	int packed;
+	/* Level of the array read into numbers or 0 */
+	unsigned int vector;
+	/* The numbers of that array */
+	double *numbers;
+	size_t nnumbers;
+	size_t numbers_size;
+
+	/* Memory of the stack and the number of elements read at
+	 * each level, kept here so it is freed if parsing is aborted */
+	unsigned int *count;
+
+	/* Path of the values passed to the callback of each() */
+	struct path *each;
+	/* Stack index of the callback */
+	int each_index;
+	/* Number of values passed to the callback */
+	unsigned int found;
+
+	/* Stack index of the table given to parse_into(), or 0 */
+	int target_index;
+	/* Stack index of the list of tables holding the old
+	 * subtables of the container open at each level */
+	int scratch_index;
+
+	/* Number of extra arguments taken by the input,
+	 * ie. 1 if the length was given after a pointer */
+	int skip;
+
+	/* Stack index of the string sink, or 0 */
+	int sink_index;
+	/* Strings longer than this are passed to the sink */
+	size_t sink_threshold;
+	/* Set while a string is passed to the sink */
+	int sinking;
+
+	/* Paths of the strings to decode as base64 */
+	struct path **base64;
+	unsigned int nbase64;
+
+	/* Limits on the length of strings, the total number of array
+	 * elements and object keys and the memory allocated while
+	 * parsing. The largest size_t means no limit */
+	size_t max_string;
+	size_t max_elements;
+	size_t max_keys;
+	size_t max_memory;
+
+	/* Use the generational collector while parsing */
+	int generational;
+};
+
+/*
+ * The type of LuaJIT cdata as returned by lua_type()
+ */
+#define LUAJIT_TCDATA 10
+
+/*
+ * The registry field holding the function which
+ * turns cdata into a const char * pointer
+ */
+#define CDATA_CAST "voorhees.cdata"
+
+/*
+ * This function returns the address of the bytes
+ * of an FFI array or pointer at index idx
+ */
+static const char *cdata_pointer(lua_State *L, int idx)
+{
+	const char *ptr;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, CDATA_CAST);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		if (luaL_dostring(L, "local cast = require 'ffi'.cast "
+				"return function(p) "
+				"return cast('const char *', p) end")) {
+			lua_error(L);
+		}
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, CDATA_CAST);
+	}
+
+	/* The result is a pointer cdata, and lua_topointer()
+	 * returns the address where that pointer is stored */
+	lua_pushvalue(L, idx);
+	lua_call(L, 1, 1);
+	ptr = *(const char *const *)lua_topointer(L, -1);
+	lua_pop(L, 1);
+	return ptr;
+}
+
+/*
+ * This function returns the bytes of the buffer at index idx and
+ * stores their number in len, or returns NULL if it isn't a buffer.
+ *
+ * Buffers are strings, userdata with a __buffer metamethod returning
+ * a light userdata pointer to the bytes and their number, and light
+ * userdata or LuaJIT cdata followed by the length as the next argument,
+ * in which case skip is set to 1. The bytes are read in place, so they
+ * must not change while they're parsed
+ */
+static const char *to_buffer(lua_State *L, int idx, size_t *len, int *skip)
+{
+	const char *ptr;
+	lua_Number n;
+
+	*skip = 0;
+	switch (lua_type(L, idx)) {
+	case LUA_TSTRING:
+		return lua_tolstring(L, idx, len);
+	case LUA_TUSERDATA:
+		if (!luaL_getmetafield(L, idx, "__buffer")) {
+			return NULL;
+		}
+		lua_pushvalue(L, idx);
+		lua_call(L, 1, 2);
+		ptr = lua_touserdata(L, -2);
+		n = lua_tonumber(L, -1);
+		lua_pop(L, 2);
+		if (n < 0 || (ptr == NULL && n > 0)) {
+			luaL_error(L, "bad __buffer result");
+		}
+		*len = (size_t)n;
+		return ptr != NULL ? ptr : "";
+	case LUA_TLIGHTUSERDATA:
+		ptr = lua_touserdata(L, idx);
+		break;
+	case LUAJIT_TCDATA:
+		ptr = cdata_pointer(L, idx);
+		break;
+	default:
+		return NULL;
+	}
+
+	n = luaL_checknumber(L, idx + 1);
+	if (n < 0 || (ptr == NULL && n > 0)) {
+		luaL_argerror(L, idx + 1, "invalid length");
+	}
+	*len = (size_t)n;
+	*skip = 1;
+	return ptr != NULL ? ptr : "";
+}
+
+/*
+ * This function initialises the input from the first argument
+ * which is either a string or a generator function
+ *
+ * Returns 0 on success. Otherwise nil and an error
+ * message is pushed and 2 is returned
+ */
+static int open_input(lua_State *L, struct parser *p)
+{
+	struct input *in = &p->in;
+
+	if (lua_gettop(L) < 1) {
+		return luaL_error(L, "too few arguments");
+	}
+
+	in->read = 0;
+	in->reader = NULL;
+	p->skip = 0;
+	switch (lua_type(L, 1)) {
+	case LUA_TFUNCTION:
+		lua_pushvalue(L, 1);
+		if (lua_pcall(L, 0, 1, 0)) {
+			lua_pushnil(L);
+			lua_insert(L, -2);
+			return 2;
+		}
+
+		in->p = (unsigned char *)lua_tolstring(L, -1, &in->len);
+		if (in->p == NULL || in->len == 0) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "string too short");
+			return 2;
+		}
+
+		in->string_index = lua_gettop(L);
+
+		/* Make sure the first chunk is at least 4
+		 * characters long if possible */
+		while (in->len < 4) {
+			lua_pushvalue(L, 1);
+			if (lua_pcall(L, 0, 1, 0) ||
+					!lua_isstring(L, -1)) {
+				in->string_index = 0;
+				lua_pop(L, 1);
+				break;
+			}
+			/* Even if the user is silly enough to pass only
+			 * 1 byte at a time we'll only concat strings
+			 * 3 times in this loop */
+			lua_concat(L, 2);
+			in->p = (unsigned char *)lua_tolstring(L, -1, &in->len);
+		}
+		break;
+	default:
+		in->p = (const unsigned char *)to_buffer(L, 1,
+				&in->len, &p->skip);
+		if (in->p == NULL) {
+			return luaL_argerror(L, 1,
+				"expected string, buffer or function");
+		}
+		if (in->len < 2) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "string too short");
+			return 2;
+		}
+		in->string_index = 0;
+	}
+
+	p->getchar = detect_encoding(in);
+	return 0;
+}
+
+/*
+ * Raises an error about the argument at index idx,
+ * or about the field opt of an options table
+ */
+static int option_error(lua_State *L, int idx, const char *opt,
+		const char *msg)
+{
+	if (opt == NULL) {
+		return luaL_argerror(L, idx, msg);
+	}
+	return luaL_error(L, "bad option '%s' (%s)", opt, msg);
+}
+
+/*
+ * These functions read the individual options from
+ * the value at index idx
+ */
+static void read_encoding(lua_State *L, struct parser *p,
+		int idx, const char *opt)
+{
+	const char *str = lua_tostring(L, idx);
+
+	if (str == NULL) {
+		option_error(L, idx, opt, "encoding must be a string");
+	}
+	if (strcasecmp(str, "utf8") == 0) {
+		p->putchar = utf8_putchar;
+	} else if (strcasecmp(str, "utf16") == 0 ||
+			strcasecmp(str, "utf16le") == 0) {
+		p->putchar = utf16le_putchar;
+	} else if (strcasecmp(str, "latin1") == 0) {
+		p->putchar = latin1_putchar;
+	} else {
+		option_error(L, idx, opt, lua_pushfstring(L,
+				"unknown encoding '%s'", str));
+	}
+}
+
+static void read_depth(lua_State *L, struct parser *p,
+		int idx, const char *opt)
+{
+	lua_Number depth = lua_tonumber(L, idx);
+
+	if (depth < 1) {
+		option_error(L, idx, opt, "depth must be 1 or greater");
+	}
+	p->depth = (unsigned int)depth;
+}
+
+static void read_path(lua_State *L, struct parser *p,
+		int idx, const char *opt)
+{
+	p->path = compile_path(L, idx);
+	if (p->path == NULL) {
+		option_error(L, idx, opt, "invalid path");
+	}
+}
+
+static void read_limit(lua_State *L, int idx, const char *opt,
+		size_t *limit)
+{
+	lua_getfield(L, idx, opt);
+	if (!lua_isnil(L, -1)) {
+		lua_Number n = lua_tonumber(L, -1);
+
+		if (!lua_isnumber(L, -1) || n < 0) {
+			option_error(L, idx, opt,
+					"must be a non-negative number");
+		}
+		*limit = n < (lua_Number)(size_t)-1 ? (size_t)n : (size_t)-1;
+	}
+	lua_pop(L, 1);
+}
+
+static void read_interval(lua_State *L, int idx, const char *opt,
+		size_t *interval)
+{
+	lua_getfield(L, idx, opt);
+	if (!lua_isnil(L, -1)) {
+		lua_Number n = lua_tonumber(L, -1);
+
+		if (!lua_isnumber(L, -1) || n < 1) {
+			option_error(L, idx, opt, "must be 1 or greater");
+		}
+		*interval = n < (lua_Number)(size_t)-1 ?
+			(size_t)n : (size_t)-1;
+	}
+	lua_pop(L, 1);
+}
+
+static void read_base64(lua_State *L, struct parser *p, int idx)
+{
+	unsigned int n = 1;
+	unsigned int i;
+
+	if (lua_istable(L, idx)) {
+		n = (unsigned int)lua_objlen(L, idx);
+	}
+
+	/* The compiled paths are kept alive in a table */
+	p->base64 = lua_newuserdata(L, n * sizeof(struct path *));
+	p->nbase64 = n;
+	lua_createtable(L, (int)n, 0);
+
+	for (i = 0; i < n; i++) {
+		if (lua_istable(L, idx)) {
+			lua_rawgeti(L, idx, (int)i + 1);
+		} else {
+			lua_pushvalue(L, idx);
+		}
+		p->base64[i] = compile_path(L, -1);
+		if (p->base64[i] == NULL) {
+			option_error(L, idx, "base64", "invalid path");
+		}
+		lua_rawseti(L, -3, (int)i + 1);
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * This function reads the optional arguments starting at index idx.
+ * These are either the encoding, depth and null value as
+ * separate arguments, or a table with those and other options
+ */
+static void read_options(lua_State *L, struct parser *p,
+		int idx, int nargs)
+{
+	p->putchar = utf8_putchar;
+	p->depth = DEFAULT_DEPTH;
+	p->null_index = lua_upvalueindex(1);
+	p->path = NULL;
+	p->packed = 0;
+	p->each = NULL;
+	p->target_index = 0;
+	p->sink_index = 0;
+	p->sink_threshold = DEFAULT_THRESHOLD;
+	p->base64 = NULL;
+	p->nbase64 = 0;
+	p->in.limit = (size_t)-1;
+	p->in.truncated = 0;
+	p->in.checkpoint = 0;
+	p->in.held = 0;
+	p->in.gc_step = -1;
+	p->in.gc_interval = DEFAULT_GC_INTERVAL;
+	p->in.gc_stopped = 0;
+	p->in.progress_index = 0;
+	p->in.progress_interval = DEFAULT_PROGRESS_INTERVAL;
+	p->in.failed = 0;
+	p->generational = 0;
+	p->max_string = (size_t)-1;
+	p->max_elements = (size_t)-1;
+	p->max_keys = (size_t)-1;
+	p->max_memory = (size_t)-1;
+
+	if (idx > nargs) {
+		return;
+	}
+
+	if (!lua_istable(L, idx)) {
+		read_encoding(L, p, idx, NULL);
+
+		if (idx + 1 <= nargs) {
+			read_depth(L, p, idx + 1, NULL);
+		}
+
+		if (idx + 2 <= nargs) {
+			p->null_index = idx + 2;
+		}
+		return;
+	}
+
+	/* Values read from the table are left on the stack
+	 * so they stay alive while parsing */
+	lua_getfield(L, idx, "encoding");
+	if (!lua_isnil(L, -1)) {
+		read_encoding(L, p, -1, "encoding");
+	}
+
+	lua_getfield(L, idx, "depth");
+	if (!lua_isnil(L, -1)) {
+		read_depth(L, p, -1, "depth");
+	}
+
+	lua_getfield(L, idx, "null");
+	if (!lua_isnil(L, -1)) {
+		p->null_index = lua_gettop(L);
+	}
+
+	lua_getfield(L, idx, "columns");
+	if (!lua_isnil(L, -1)) {
+		read_path(L, p, -1, "columns");
+	}
+
+	lua_getfield(L, idx, "packed");
+	p->packed = lua_toboolean(L, -1);
+
+	lua_getfield(L, idx, "string_sink");
+	if (!lua_isnil(L, -1)) {
+		if (!lua_isfunction(L, -1)) {
+			option_error(L, idx, "string_sink",
+					"must be a function");
+		}
+		p->sink_index = lua_gettop(L);
+	}
+
+	lua_getfield(L, idx, "string_threshold");
+	if (!lua_isnil(L, -1)) {
+		lua_Number n = lua_tonumber(L, -1);
+
+		if (!lua_isnumber(L, -1) || n < 0) {
+			option_error(L, idx, "string_threshold",
+					"must be a non-negative number");
+		}
+		p->sink_threshold = (size_t)n;
+	}
+
+	lua_getfield(L, idx, "base64");
+	if (!lua_isnil(L, -1)) {
+		read_base64(L, p, lua_gettop(L));
+	}
+
+	read_limit(L, idx, "max_bytes", &p->in.limit);
+	read_limit(L, idx, "max_string", &p->max_string);
+	read_limit(L, idx, "max_elements", &p->max_elements);
+	read_limit(L, idx, "max_keys", &p->max_keys);
+	read_limit(L, idx, "max_memory", &p->max_memory);
+
+	lua_getfield(L, idx, "gc_step");
+	if (!lua_isnil(L, -1)) {
+		lua_Number n = lua_tonumber(L, -1);
+
+		if (!lua_isnumber(L, -1) || n < 0) {
+			option_error(L, idx, "gc_step",
+					"must be a non-negative number");
+		}
+		p->in.gc_step = n < INT_MAX ? (int)n : INT_MAX;
+	}
+	read_interval(L, idx, "gc_interval", &p->in.gc_interval);
+
+	lua_getfield(L, idx, "progress");
+	if (!lua_isnil(L, -1)) {
+		if (!lua_isfunction(L, -1)) {
+			option_error(L, idx, "progress",
+					"must be a function");
+		}
+		p->in.progress_index = lua_gettop(L);
+	}
+	read_interval(L, idx, "progress_interval",
+			&p->in.progress_interval);
+
+	lua_getfield(L, idx, "generational");
+	p->generational = lua_toboolean(L, -1);
+}
+
+/*
+ * Arrays of numbers are decoded into a userdata
+ * with this layout when the packed option is set
+ */
+struct vector {
+	size_t n;
+	double v[1];
+};
+
+#define VECTOR_MT "voorhees.vector"
+
+/*
+ * This function appends a number to the array read into numbers
+ */
+static int push_number(struct parser *p, double number)
+{
+	if (p->nnumbers == p->numbers_size) {
+		size_t size = p->numbers_size ? 2 * p->numbers_size : 64;
+		double *numbers = realloc(p->numbers, size * sizeof(double));
+
+		if (numbers == NULL)
+			return -1;
+
+		p->numbers = numbers;
+		p->numbers_size = size;
+	}
+
+	p->numbers[p->nnumbers++] = number;
+	return 0;
+}
+
+/*
+ * This function is called when something else than a number is
+ * read in the array read into numbers. The numbers are moved to
+ * the array table on top of the stack which is then used as usual
+ */
+static void unpack_numbers(lua_State *L, struct parser *p)
+{
+	size_t i;
+
+	for (i = 0; i < p->nnumbers; i++) {
+		lua_pushnumber(L, p->numbers[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	p->nnumbers = 0;
+	p->vector = 0;
+}
+
+/*
+ * This function replaces the array table on top of the stack
+ * with a vector holding the numbers read
+ */
+static void push_vector(lua_State *L, struct parser *p)
+{
+	struct vector *v = lua_newuserdata(L, sizeof(struct vector) +
+			(p->nnumbers - 1) * sizeof(double));
+
+	v->n = p->nnumbers;
+	memcpy(v->v, p->numbers, p->nnumbers * sizeof(double));
+	luaL_getmetatable(L, VECTOR_MT);
+	lua_setmetatable(L, -2);
+	lua_replace(L, -2);
+
+	p->nnumbers = 0;
+	p->vector = 0;
+}
+
+/*
+ * This function stores the value on top of the stack
+ * with the key below it in the table of columns below that,
+ * ie. it does columns[key][row] = value and pops the
+ * key and value
+ */
+static void store_column(lua_State *L, struct parser *p, unsigned int row)
+{
+	lua_pushvalue(L, -2);
+	lua_rawget(L, -4);
+	if (lua_isnil(L, -1)) {
+		unsigned int i;
+
+		/* New column, so fill in the rows before this */
+		lua_pop(L, 1);
+		lua_createtable(L, row, 0);
+		for (i = 1; i < row; i++) {
+			lua_pushvalue(L, p->null_index);
+			lua_rawseti(L, -2, i);
+		}
+		lua_pushvalue(L, -3);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -6);
+	}
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, row);
+	lua_pop(L, 2);
+}
+
+/*
+ * This function fills in null for the columns not present in the
+ * row which just ended and pops the table of columns
+ */
+static void end_row(lua_State *L, struct parser *p, unsigned int row)
+{
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		lua_rawgeti(L, -1, row);
+		if (lua_isnil(L, -1)) {
+			lua_pushvalue(L, p->null_index);
+			lua_rawseti(L, -3, row);
+		}
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * This function pushes the table of a new array or object
+ * in the container at level top.
+ *
+ * When decoding into an existing table the old table at the same
+ * index or key is reused. Its contents are cleared, but the
+ * subtables are moved aside to the scratch table of the new level
+ * so they can be reused in turn
+ */
+static void new_table(lua_State *L, struct parser *p, unsigned int top,
+		signed char mode, unsigned int index)
+{
+	if (p->target_index == 0) {
+		lua_newtable(L);
+		return;
+	}
+
+	if (top == 0) {
+		lua_pushvalue(L, p->target_index);
+	} else {
+		lua_rawgeti(L, p->scratch_index, top);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			return;
+		}
+		if (mode == MODE_ARRAY) {
+			lua_rawgeti(L, -1, index + 1);
+		} else {
+			/* The key is below the scratch table */
+			lua_pushvalue(L, -2);
+			lua_rawget(L, -2);
+		}
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 2);
+			lua_newtable(L);
+			return;
+		}
+
+		/* Take it out of the scratch table so only
+		 * the unused subtables are left there */
+		if (mode == MODE_ARRAY) {
+			lua_pushnil(L);
+			lua_rawseti(L, -3, index + 1);
+		} else {
+			lua_pushvalue(L, -3);
+			lua_pushnil(L);
+			lua_rawset(L, -4);
+		}
+		lua_remove(L, -2);
+	}
+
+	lua_rawgeti(L, p->scratch_index, top + 1);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, p->scratch_index, top + 1);
+	}
+
+	/* Setting existing fields to nil doesn't shrink the
+	 * table, so refilling it won't allocate anything */
+	lua_pushnil(L);
+	while (lua_next(L, -3)) {
+		if (lua_istable(L, -1)) {
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -4);
+		} else {
+			lua_pop(L, 1);
+		}
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, -5);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * This function is called when the container at level top ends
+ */
+static void end_level(lua_State *L, struct parser *p, unsigned int top)
+{
+	if (p->path != NULL && p->path->deep == top)
+		p->path->deep--;
+	if (p->each != NULL && p->each->deep == top)
+		p->each->deep--;
+
+	/* Drop the old subtables which weren't reused */
+	if (p->target_index != 0) {
+		lua_rawgeti(L, p->scratch_index, top);
+		if (!lua_isnil(L, -1)) {
+			lua_pushnil(L);
+			while (lua_next(L, -2)) {
+				lua_pop(L, 1);
+				lua_pushvalue(L, -1);
+				lua_pushnil(L);
+				lua_rawset(L, -4);
+			}
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * This function is called before the value on top of the stack is
+ * stored in the container at level top. If the value is at the end
+ * of the path given to each() it is passed to the callback and
+ * popped together with its key.
+ *
+ * Returns 1 if the value was passed to the callback and 0 if not.
+ * Returns -1 with the error message on the stack if the callback
+ * raised an error and -2 if it returned false
+ */
+static int each_value(lua_State *L, struct parser *p, unsigned int top,
+		signed char mode, unsigned int index)
+{
+	if (path_step(L, p->each, top, mode, index, -2) != 1)
+		return 0;
+
+	lua_pushvalue(L, p->each_index);
+	lua_insert(L, -2);
+	if (lua_pcall(L, 1, 1, 0))
+		return -1;
+
+	p->found++;
+	if (lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+		return -2;
+
+	lua_pop(L, mode == MODE_ARRAY ? 1 : 2);
+	return 1;
+}
+
+/*
+ * This function pushes the JSON pointer of the value being read.
+ * The Lua stack above base holds the table of each open container
+ * followed by the key of the value being read if it's an object
+ */
+static void push_path(lua_State *L, const signed char *stack,
+		const unsigned int *count, unsigned int top, int base)
+{
+	luaL_Buffer b;
+	unsigned int level;
+	int idx = base;
+
+	luaL_buffinit(L, &b);
+	for (level = 1; level <= top; level++) {
+		idx++;
+		luaL_addchar(&b, '/');
+		if (stack[level] == MODE_ARRAY) {
+			char num[32];
+
+			sprintf(num, "%u", count[level]);
+			luaL_addstring(&b, num);
+		} else {
+			size_t len;
+			const char *key;
+
+			idx++;
+			key = lua_tolstring(L, idx, &len);
+			for (; len; key++, len--) {
+				switch (*key) {
+				case '~':
+					luaL_addstring(&b, "~0");
+					break;
+				case '/':
+					luaL_addstring(&b, "~1");
+					break;
+				default:
+					luaL_addchar(&b, *key);
+				}
+			}
+		}
+	}
+	luaL_pushresult(&b);
+}
+
+/*
+ * This function passes the string parts on top of the stack to the
+ * string sink as one chunk. On the first call for a string its path
+ * is pushed below the parts. On the last call the path is replaced
+ * by what the sink returns, or the length of the string if that's nil.
+ * r is the number of values pushed by the parser.
+ *
+ * Returns 0 on success and -1 with the error message on the
+ * stack if the sink raised an error
+ */
+static int sink_string(lua_State *L, struct parser *p, struct strbuf *s,
+		const signed char *stack, const unsigned int *count,
+		unsigned int top, int base, int *r, size_t len, int last)
+{
+	luaL_checkstack(L, 6, "out of memory");
+
+	if (!p->sinking) {
+		push_path(L, stack, count, top, base);
+		lua_insert(L, -(int)s->parts - 1);
+		(*r)++;
+		p->sinking = 1;
+	}
+
+	lua_concat(L, s->parts);
+	*r += 1 - s->parts;
+	s->parts = 0;
+
+	lua_pushvalue(L, p->sink_index);
+	lua_pushvalue(L, -3);
+	lua_pushvalue(L, -3);
+	lua_pushboolean(L, last);
+	if (lua_pcall(L, 3, 1, 0))
+		return -1;
+
+	if (!last) {
+		/* Pop the result and the chunk */
+		lua_pop(L, 2);
+		(*r)--;
+		return 0;
+	}
+
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushnumber(L, (lua_Number)len);
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	(*r)--;
+	p->sinking = 0;
+	return 0;
+}
+
+/*
+ * This macro pushes the contents of the string buffer
+ * to the Lua stack. All the pieces will be
+ * lua_concat()'ed in the end.
+ */
+#define flush_buffer() \
+	luaL_checkstack(L, 1, "out of memory"); \
+	lua_pushlstring(L, s.base, s.written); \
+	r++; \
+	slen += s.written; \
+	s.parts++; \
+	s.written = 0; \
+	s.p = s.base
+
+/*
+ * This macro is used instead of flush_buffer() in strings.
+ * Strings are checked against max_string, and values longer than
+ * the threshold are passed on to the string sink in chunks of
+ * SINK_PARTS buffers
+ */
+#define flush_string() do { \
+	flush_buffer(); \
+	if (slen > p->max_string) { \
+		goto limit_exceeded; \
+	} \
+	if (p->sink_index && stack[top] != MODE_KEY && \
+			slen > p->sink_threshold && \
+			s.parts >= SINK_PARTS) { \
+		e = sink_string(L, p, &s, stack, count, top, base, \
+				&r, slen, 0); \
+		if (e < 0) { \
+			goto callback_done; \
+		} \
+	} \
+} while (0)
+
+/*
+ * This function frees the memory allocated by parse()
+ */
+static void free_parse(struct parser *p)
+{
+	free(p->count);
+	free(p->numbers);
+	p->count = NULL;
+	p->numbers = NULL;
+}
+
+/*
+ * This is the parser shared by the functions exported to Lua
+ *
+ * The loop reads a character from the input
+ * and looks up the next state or action in the state
+ * table and performs the corresponding actions
+ * until the JSON document is finished or a
+ * syntax or encoding error occurs
+ *
+ * The last part checks if everything went alright,
+ * frees the stack and returns the parsed array
+ * or object table
+ */
+static int parse(lua_State *L, struct parser *p)
+{
+	struct strbuf s;
+	int next_char;
+	signed char *stack;
+	unsigned int *count;
+	unsigned int top = 0;
+	signed char state = GO;
+	int high_sur = 0;
+	int unicode = 0;
+	int r = 0;
+	int m;
+	int e;
+	double number;
+	size_t slen = 0;
+	int base = lua_gettop(L);
+	/* Number of base64 characters read into bits, or -1
+	 * if the string isn't decoded as base64 */
+	int b64 = -1;
+	unsigned long bits = 0;
+	unsigned int i;
+	size_t elements = 0;
+	size_t keys = 0;
+
+	/* Expand the Lua stack size so we have room enough to parse
+	 * the JSON documents of maximum depth */
+	luaL_checkstack(L, 2 * p->depth + 8, "out of memory");
+
+	/* Allocate memory for the stack and the number of
+	 * elements read at each level */
+	count = malloc(p->depth * (sizeof(unsigned int) + 1));
+	if (count == NULL) {
+		return luaL_error(L, "out of memory");
+	}
+	p->count = count;
+	stack = (signed char *)(count + p->depth);
+	stack[0] = MODE_DONE;
+
+	p->columns = 0;
+	p->row = 0;
+	p->vector = 0;
+	p->numbers = NULL;
+	p->nnumbers = 0;
+	p->numbers_size = 0;
+	p->found = 0;
+	p->sinking = 0;
+	if (p->path != NULL) {
+		p->path->deep = 0;
+	}
+	if (p->each != NULL) {
+		p->each->deep = 0;
+	}
+
+	/* Initialise the string buffer */
+	s.parts = 0;
+	s.written = 0;
+	s.p = s.base;
+
+	/* The first chunk was read before the limits were known */
+	start_input(&p->in);
+
+	while ((next_char = p->getchar(L, &p->in)) > 0) {
+		signed char next_class;
+		
+		/* Determine the character's class. */
+		if (next_char >= 126) {
+			next_class = C_ETC;
+		} else {
+			next_class = ascii_class[next_char];
+			if (next_class <= __) {
+				goto syntax_error;
+			}
+		}
+
+again:
+		/* Get the next state/action from the state transition table */
+		state = state_transition_table[state][next_class];
+
+		/* Perform actions according to the state/action */
+		switch (state) {
+		case N1:
+			if (p->vector == top) {
+				unpack_numbers(L, p);
+			}
+			lua_pushvalue(L, p->null_index);
+			r++;
+			break;
+
+		case T1:
+			if (p->vector == top) {
+				unpack_numbers(L, p);
+			}
+			lua_pushboolean(L, 1);
+			r++;
+			break;
+
+		case F1:
+			if (p->vector == top) {
+				unpack_numbers(L, p);
+			}
+			lua_pushboolean(L, 0);
+			r++;
+			break;
+
+		case MI:
+		case ZE:
+		case IT:
+		case FP:
+		case FR:
+		case E1:
+		case E2:
+		case E3:
+			*s.p++ = (char)next_char;
+			s.written++;
+			if (s.written == STRBUF_SIZE) {
+				flush_buffer();
+			}
+			break;
+
+		case XS: /* begin string */
+			if (p->vector == top) {
+				unpack_numbers(L, p);
+			}
+			/* this is a special action, so we
+			 * don't push the beginning " */
+			slen = 0;
+			if (stack[top] != MODE_KEY) {
+				for (i = 0; i < p->nbase64; i++) {
+					if (path_match(L, p->base64[i], stack,
+							count, top, base)) {
+						b64 = 0;
+						bits = 0;
+						break;
+					}
+				}
+			}
+			state = ST;
+			break;
+
+		case ST:
+			if (b64 < 0) {
+				p->putchar(&s, next_char);
+			} else if (base64_putchar(&s, &bits, &b64,
+						next_char)) {
+				goto syntax_error;
+			} else if (b64 == 0 && p->getchar == utf8_getchar) {
+				while (base64_fast(&p->in, &s)) {
+					flush_string();
+				}
+			}
+			if (s.written >= (STRBUF_SIZE - 4)) {
+				flush_string();
+			}
+			break;
+
+		case YE: /* put an escaped character */
+			if (b64 >= 0) {
+				/* Only \/ is in the base64 alphabet */
+				if (next_char != '/' || base64_putchar(&s,
+							&bits, &b64, '/')) {
+					goto syntax_error;
+				}
+				state = ST;
+				break;
+			}
+			switch (next_char) {
+			case 'b':
+				p->putchar(&s, '\b');
+				break;
+			case 'f':
+				p->putchar(&s, '\f');
+				break;
+			case 'n':
+				p->putchar(&s, '\n');
+				break;
+			case 'r':
+				p->putchar(&s, '\r');
+				break;
+			case 't':
+				p->putchar(&s, '\t');
+				break;
+			default:
+				p->putchar(&s, next_char);
+			}
+			if (s.written >= (STRBUF_SIZE - 4)) {
+				flush_string();
+			}
+			state = ST;
+			break;
+
+		case U1: /* begin escaped unicode character */
+			if (high_sur == 0 && p->getchar == utf8_getchar &&
+					(unicode = fast_unicode(&p->in)) >= 0) {
+				if (b64 < 0) {
+					p->putchar(&s, unicode);
+				} else if (base64_putchar(&s, &bits, &b64,
+							unicode)) {
+					goto syntax_error;
+				}
+				if (s.written >= (STRBUF_SIZE - 4)) {
+					flush_string();
+				}
+				state = ST;
+			}
+			unicode = 0;
+			break;
+
+		case U3:
+		case U4:
+			unicode <<= 4;
+		case U2:
+			if (next_char <= '9') {
+				unicode |= (next_char - '0');
+			} else if (next_char <= 'F') {
+				unicode |= next_char - 55;
+			} else {
+				unicode |= next_char - 87;
+			}
+			break;
+
+		case YU: /* write the escaped unicode character */
+			/* Read the last hex char */
+			unicode <<= 4;
+			if (next_char <= '9') {
+				unicode |= next_char - '0';
+			} else if (next_char <= 'F') {
+				unicode |= next_char - 55;
+			} else {
+				unicode |= next_char - 87;
+			}
+			/* If its a high surrogate.. */
+			if (unicode >= 0xD800 && unicode < 0xDC00) {
+				high_sur = unicode;
+				state = L1; /* ..the low must follow */
+			} else {
+				/* Should this be a low surrogate? */
+				if (high_sur) { 
+					if (unicode < 0xDC00 ||
+							unicode >= 0xE000)
+						goto syntax_error;
+
+					unicode &= 1023;
+					unicode |= (high_sur & 1023) << 10;
+					unicode |= 0x10000;
+					high_sur = 0;
+				} else if (unicode >= 0xDC00 &&
+						unicode < 0xE000) {
+					goto syntax_error;
+				}
+				if (b64 < 0) {
+					p->putchar(&s, unicode);
+				} else if (base64_putchar(&s, &bits, &b64,
+							unicode)) {
+					goto syntax_error;
+				}
+				if (s.written >= (STRBUF_SIZE - 4)) {
+					flush_string();
+				}
+				state = ST;
+			}
+			unicode = 0;
+			break;
+
+		case XA: /* begin array */
+			if (p->vector == top) {
+				unpack_numbers(L, p);
+			}
+			m = 0;
+			if (p->path != NULL && p->columns == 0) {
+				m = path_step(L, p->path, top,
+						stack[top], count[top], -1);
+			}
+			e = 0;
+			if (p->each != NULL) {
+				e = path_step(L, p->each, top,
+						stack[top], count[top], -1);
+			}
+			top++;
+			if (top == p->depth) {
+				goto stack_overflow;
+			}
+			stack[top] = MODE_ARRAY;
+			count[top] = 0;
+			new_table(L, p, top - 1, stack[top - 1], count[top - 1]);
+			r++;
+			if (m == 2) {
+				p->path->deep = top;
+			} else if (m == 1) {
+				/* This array becomes the table of columns */
+				p->columns = top;
+				p->columns_index = lua_gettop(L);
+			}
+			if (e == 2) {
+				p->each->deep = top;
+			}
+			if (p->packed && m != 1 &&
+					(e != 2 || top != p->each->n)) {
+				/* Read numbers into a vector until
+				 * we see something else */
+				p->vector = top;
+			}
+			state = A0;
+			break;
+
+		case XO: /* begin object */
+			if (p->vector == top) {
+				unpack_numbers(L, p);
+			}
+			m = 0;
+			if (p->columns != 0) {
+				/* Rows are read directly into
+				 * the table of columns */
+				if (top == p->columns) {
+					m = 3;
+				}
+			} else if (p->path != NULL) {
+				m = path_step(L, p->path, top,
+						stack[top], count[top], -1);
+				if (m == 1) {
+					/* The columns must be an array */
+					goto not_an_array;
+				}
+			}
+			e = 0;
+			if (p->each != NULL) {
+				e = path_step(L, p->each, top,
+						stack[top], count[top], -1);
+			}
+			top++;
+			if (top == p->depth) {
+				goto stack_overflow;
+			}
+			stack[top] = MODE_KEY;
+			if (m == 3) {
+				lua_pushvalue(L, p->columns_index);
+			} else {
+				new_table(L, p, top - 1,
+						stack[top - 1], count[top - 1]);
+			}
 			r++;
+			if (m == 2) {
+				p->path->deep = top;
+			}
+			if (e == 2) {
+				p->each->deep = top;
+			}
+			state = OB;
+			break;
+
+		case ZN: /* end number */
+			if (s.parts == 0) {
+				/* Convert the number directly from
+				 * the string buffer. There is always
+				 * room for the terminating zero */
+				*s.p = '\0';
+				number = strtod(s.base, NULL);
+				s.written = 0;
+				s.p = s.base;
+			} else {
+				if (s.written) {
+					flush_buffer();
+				}
+				lua_concat(L, s.parts);
+				r -= s.parts;
+				s.parts = 0;
+				number = lua_tonumber(L, -1);
+				lua_pop(L, 1);
+			}
+			if (p->vector == top) {
+				if (push_number(p, number)) {
+					goto out_of_memory;
+				}
+			} else {
+				lua_pushnumber(L, number);
+				r++;
+			}
+			state = OK;
+			goto again;
+
+		case ZS: /* end string */
+			if (b64 >= 0) {
+				/* The padding must be complete */
+				if (b64 != 0 && b64 != 8) {
+					goto syntax_error;
+				}
+				b64 = -1;
+			}
+			if (s.written) {
+				flush_buffer();
+			}
+			if (slen > p->max_string) {
+				goto limit_exceeded;
+			}
+			if (p->sink_index && stack[top] != MODE_KEY &&
+					slen > p->sink_threshold) {
+				e = sink_string(L, p, &s, stack, count, top,
+						base, &r, slen, 1);
+				if (e < 0) {
+					goto callback_done;
+				}
+			} else {
+				lua_concat(L, s.parts);
+				r += 1 - s.parts;
+				s.parts = 0;
+			}
+			switch (stack[top]) {
+			case MODE_KEY:
+				state = CO;
+				break;
+			case MODE_ARRAY:
+			case MODE_OBJECT:
+				state = OK;
+				break;
+			default:
+				goto syntax_error;
+			}
+			break;
+
+		case Z0: /* end empty array */
+			if (stack[top] != MODE_ARRAY) {
+				goto syntax_error;
+			}
+			if (top == p->columns) {
+				p->columns = 0;
+			}
+			if (p->vector == top) {
+				p->vector = 0;
+			}
+			end_level(L, p, top);
+			top--;
+			state = OK;
+			break;
+
+		case ZA: /* end array */
+			if (stack[top] != MODE_ARRAY) {
+				goto syntax_error;
+			}
+			if (++elements > p->max_elements) {
+				goto limit_exceeded;
+			}
+			if (top == p->columns) {
+				if (!p->row) {
+					goto not_an_object;
+				}
+				p->columns = 0;
+			} else if (p->vector == top) {
+				push_vector(L, p);
+			} else if (p->each != NULL && (e = each_value(L, p,
+						top, MODE_ARRAY, count[top]))) {
+				if (e < 0) {
+					goto callback_done;
+				}
+				r--;
+			} else {
+				lua_rawseti(L, -2, ++count[top]);
+				r--;
+			}
+			end_level(L, p, top);
+			top--;
+			state = OK;
+			break;
+
+		case ZQ: /* end empty object */
+			if (stack[top] != MODE_KEY) {
+				goto syntax_error;
+			}
+			if (p->columns != 0 && top == p->columns + 1) {
+				end_row(L, p, ++count[p->columns]);
+				r--;
+				p->row = 1;
+			}
+			end_level(L, p, top);
+			top--;
+			state = OK;
+			break;
+
+		case ZO: /* end object */
+			if (stack[top] != MODE_OBJECT) {
+				goto syntax_error;
+			}
+			if (p->each != NULL && (e = each_value(L, p,
+						top, MODE_OBJECT, 0))) {
+				if (e < 0) {
+					goto callback_done;
+				}
+			} else if (p->columns != 0 && top == p->columns + 1) {
+				store_column(L, p, count[p->columns] + 1);
+			} else {
+				lua_rawset(L, -3);
+			}
+			r -= 2;
+			if (p->columns != 0 && top == p->columns + 1) {
+				end_row(L, p, ++count[p->columns]);
+				r--;
+				p->row = 1;
+			}
+			end_level(L, p, top);
+			top--;
+			state = OK;
+			break;
+
+		case YN: /* next key/value pair or array entry */
+			switch (stack[top]) {
+			case MODE_OBJECT:
+				/* A comma causes a flip from
+				 * object mode to key mode. */
+				stack[top] = MODE_KEY;
+				if (p->each != NULL && (e = each_value(L, p,
+						top, MODE_OBJECT, 0))) {
+					if (e < 0) {
+						goto callback_done;
+					}
+				} else if (p->columns != 0 &&
+						top == p->columns + 1) {
+					store_column(L, p,
+						count[p->columns] + 1);
+				} else {
+					lua_rawset(L, -3);
+				}
+				r -= 2;
+				state = KE;
+				break;
+			case MODE_ARRAY:
+				if (++elements > p->max_elements) {
+					goto limit_exceeded;
+				}
+				if (top == p->columns) {
+					if (!p->row) {
+						goto not_an_object;
+					}
+					p->row = 0;
+				} else if (p->vector == top) {
+					count[top]++;
+				} else if (p->each != NULL &&
+						(e = each_value(L, p, top,
+						MODE_ARRAY, count[top]))) {
+					if (e < 0) {
+						goto callback_done;
+					}
+					count[top]++;
+					r--;
+				} else {
+					lua_rawseti(L, -2, ++count[top]);
+					r--;
+				}
+				state = VA;
+				break;
+			default:
+				goto syntax_error;
+			}
+			break;
+
+		case YV: /* key read, now read the value */
+			/* A colon causes a flip from key mode
+			 * to object mode. */
+			if (stack[top] != MODE_KEY) {
+				goto syntax_error;
+			}
+			if (++keys > p->max_keys) {
+				goto limit_exceeded;
+			}
+			stack[top] = MODE_OBJECT;
+			state = VA;
+			break;
+
+		case __: /* bad state */
+			goto syntax_error;
+		}
+	}
+
+	/*
+	 * Check everything went alright,
+	 * free the stack and return
+	 */
+
+	/* Did the progress function raise an error? */
+	if (p->in.failed) {
+		lua_pop(L, r);
+		free_parse(p);
+		lua_pushvalue(L, p->in.progress_index);
+		return lua_error(L);
+	}
+
+	/* Was the input cut short at its limit? */
+	if (p->in.truncated) {
+		goto limit_exceeded;
+	}
+
+	/* Did we encounter an encoding error? */
+	if (next_char < 0) {
+		lua_pop(L, r);
+		free_parse(p);
+		lua_pushnil(L);
+		lua_pushfstring(L, "encoding error after %d bytes",
+				(int)p->in.read);
+		return 2;
+	}
+
+	/* Check if the JSON text finish properly */
+	if (state != OK || stack[top] != MODE_DONE) {
+		goto syntax_error;
+	}
+
+	free_parse(p);
+
+	/* If this fails we did something wrong */
+	if (r != 1) {
+		lua_pop(L, r);
+		lua_pushnil(L);
+		lua_pushfstring(L, "r = %d", r);
+		return 2;
+	}
+
+	if (p->each != NULL) {
+		/* The document itself may be on the path */
+		if (p->each->n == 0) {
+			lua_pushvalue(L, p->each_index);
+			lua_insert(L, -2);
+			lua_call(L, 1, 0);
+			p->found++;
+		}
+		lua_settop(L, base);
+		lua_pushnumber(L, (lua_Number)p->found);
+	}
+
+	return 1;
+
+	/*
+	 * We jump to here in case of errors encountered
+	 * while parsing
+	 */
+syntax_error:
+	lua_pop(L, r);
+	free_parse(p);
+	lua_pushnil(L);
+	lua_pushfstring(L, "syntax error after %d bytes", (int)p->in.read);
+	return 2;
+
+stack_overflow:
+	lua_pop(L, r);
+	free_parse(p);
+	lua_pushnil(L);
+	lua_pushliteral(L, "stack overflow");
+	return 2;
+
+limit_exceeded:
+	lua_pop(L, r);
+	free_parse(p);
+	lua_pushnil(L);
+	lua_pushfstring(L, "limit exceeded after %d bytes", (int)p->in.read);
+	return 2;
+
+not_an_object:
+	lua_pop(L, r);
+	free_parse(p);
+	lua_pushnil(L);
+	lua_pushfstring(L, "expected object after %d bytes", (int)p->in.read);
+	return 2;
+
+not_an_array:
+	lua_pop(L, r);
+	free_parse(p);
+	lua_pushnil(L);
+	lua_pushfstring(L, "expected array after %d bytes", (int)p->in.read);
+	return 2;
+
+out_of_memory:
+	free_parse(p);
+	return luaL_error(L, "out of memory");
+
+	/*
+	 * We jump to here if the callback of each()
+	 * raised an error or returned false
+	 */
+callback_done:
+	free_parse(p);
+	if (e == -1) {
+		return lua_error(L);
+	}
+	lua_settop(L, base);
+	lua_pushnumber(L, (lua_Number)p->found);
+	return 1;
+}
+
+/*
+ * Allocator installed while parsing with the max_memory option. It
+ * counts the memory allocated through the allocator of the state and
+ * fails allocations which would take it over the limit
+ */
+struct governor {
+	lua_Alloc alloc;
+	void *ud;
+	size_t used;
+	size_t limit;
+	int exceeded;
+};
+
+static void *governed_alloc(void *ud, void *ptr, size_t osize,
+		size_t nsize)
+{
+	struct governor *g = ud;
+	/* Newer versions of Lua pass the type of new objects in osize */
+	size_t old = ptr == NULL ? 0 : osize;
+	void *q;
+
+	if (nsize > old && nsize - old > g->limit - g->used) {
+		g->exceeded = 1;
+		return NULL;
+	}
+
+	q = g->alloc(g->ud, ptr, osize, nsize);
+	if (q != NULL || nsize == 0) {
+		if (nsize > old) {
+			g->used += nsize - old;
+		} else if (g->used > old - nsize) {
+			g->used -= old - nsize;
+		} else {
+			/* Memory allocated before parsing was freed */
+			g->used = 0;
+		}
+	}
+	return q;
+}
+
+static int protected_parse(lua_State *L)
+{
+	return parse(L, lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+/*
+ * This function runs the parser. With the max_memory option the
+ * counting allocator is installed, and with the gc_step option the
+ * collector is stopped and only stepped at the checkpoints. Then the
+ * parser is run in a protected call, so the allocator and collector
+ * are restored and its memory freed however the parser returns. A
+ * limit error is only reported if the allocator failed the parser
+ */
+static int run_parse(lua_State *L, struct parser *p)
+{
+	struct governor g;
+	int running = 1;
+	int n;
+	int i;
+	int err;
+#if LUA_VERSION_NUM >= 504
+	int mode = LUA_GCGEN;
+#endif
+
+	if (p->max_memory == (size_t)-1 && p->in.gc_step < 0
+#if LUA_VERSION_NUM >= 504
+			&& !p->generational
+#endif
+			) {
+		return parse(L, p);
+	}
+
+	/* The parser refers to values by their stack index, so they're
+	 * all passed on to the protected call in the same places */
+	if (p->null_index == lua_upvalueindex(1)) {
+		lua_pushvalue(L, p->null_index);
+		p->null_index = lua_gettop(L);
+	}
+	n = lua_gettop(L);
+	luaL_checkstack(L, n + 2, "out of memory");
+	lua_pushlightuserdata(L, p);
+	lua_pushcclosure(L, protected_parse, 1);
+	for (i = 1; i <= n; i++) {
+		lua_pushvalue(L, i);
+	}
+
+	p->count = NULL;
+	p->numbers = NULL;
+
+	g.alloc = lua_getallocf(L, &g.ud);
+	g.used = 0;
+	g.limit = p->max_memory;
+	g.exceeded = 0;
+	if (p->max_memory != (size_t)-1) {
+		lua_setallocf(L, governed_alloc, &g);
+	}
+	if (p->in.gc_step >= 0) {
+		/* Lua 5.1 can't tell if the collector was stopped
+		 * before, so there it is always restarted */
+#ifdef LUA_GCISRUNNING
+		running = lua_gc(L, LUA_GCISRUNNING, 0);
+#endif
+		lua_gc(L, LUA_GCSTOP, 0);
+		p->in.gc_stopped = 1;
+	}
+#if LUA_VERSION_NUM >= 504
+	if (p->generational) {
+		mode = lua_gc(L, LUA_GCGEN, 0, 0);
+	}
+#endif
+
+	err = lua_pcall(L, n, LUA_MULTRET, 0);
+
+#if LUA_VERSION_NUM >= 504
+	if (mode == LUA_GCINC) {
+		lua_gc(L, LUA_GCINC, 0, 0, 0);
+	}
+#endif
+	if (p->in.gc_step >= 0 && running) {
+		lua_gc(L, LUA_GCRESTART, 0);
+	}
+	lua_setallocf(L, g.alloc, g.ud);
+
+	if (err) {
+		/* The parser didn't get to free its memory */
+		free_parse(p);
+	}
+	if (err && g.exceeded) {
+		lua_settop(L, n);
+		lua_pushnil(L);
+		lua_pushfstring(L, "limit exceeded after %d bytes",
+				(int)p->in.read);
+		return 2;
+	}
+	if (err) {
+		return lua_error(L);
+	}
+	return lua_gettop(L) - n;
+}
+
+/*
+ * Size of the chunks passed to the writer of transcode()
+ */
+#define TRANSCODE_SIZE (64 * 1024)
+
+/*
+ * This function writes \uXXXX escapes for the character c
+ */
+static void put_unicode_escape(putchar_func put, struct strbuf *s, int c)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	if (c >= 0x10000) {
+		c -= 0x10000;
+		put_unicode_escape(put, s, 0xD800 | (c >> 10));
+		c = 0xDC00 | (c & 1023);
+	}
+
+	put(s, '\\');
+	put(s, 'u');
+	put(s, hex[(c >> 12) & 15]);
+	put(s, hex[(c >> 8) & 15]);
+	put(s, hex[(c >> 4) & 15]);
+	put(s, hex[c & 15]);
+}
+
+/*
+ * This function writes the character c of a string escaping only
+ * what must be escaped, and all non-ASCII characters if ascii is set.
+ * Characters which can't be written in latin-1 are escaped too
+ */
+static void put_string_char(putchar_func put, struct strbuf *s,
+		int c, int ascii)
+{
+	switch (c) {
+	case '"':
+	case '\\':
+		put(s, '\\');
+		put(s, c);
+		return;
+	case '\b':
+		put(s, '\\');
+		put(s, 'b');
+		return;
+	case '\f':
+		put(s, '\\');
+		put(s, 'f');
+		return;
+	case '\n':
+		put(s, '\\');
+		put(s, 'n');
+		return;
+	case '\r':
+		put(s, '\\');
+		put(s, 'r');
+		return;
+	case '\t':
+		put(s, '\\');
+		put(s, 't');
+		return;
+	}
+
+	if (c < 0x20 || (c >= 0x80 && ascii) ||
+			(c >= 0x100 && put == latin1_putchar)) {
+		put_unicode_escape(put, s, c);
+	} else {
+		put(s, c);
+	}
+}
+
+/*
+ * This macro passes the output buffer to the writer
+ */
+#define flush_output() do { \
+	lua_pushvalue(L, writer); \
+	lua_pushlstring(L, out, s.written); \
+	lua_call(L, 1, 0); \
+	s.written = 0; \
+	s.p = out; \
+} while (0)
+
+/*
+ * This is the loop of transcode()
+ *
+ * It runs the same automaton as the parser, but instead of building
+ * Lua values the document is written to the function at the stack
+ * index writer in chunks of TRANSCODE_SIZE bytes. Whitespace is
+ * dropped if minify is set, and strings are unescaped and escaped
+ * again so the result only escapes what is needed
+ */
+static int transcode(lua_State *L, struct parser *p, int writer,
+		int minify, int ascii)
+{
+	struct strbuf s;
+	putchar_func put = p->putchar;
+	char *out;
+	signed char *stack;
+	unsigned int top = 0;
+	int state = GO;
+	int next_char;
+	int high_sur = 0;
+	int unicode = 0;
+
+	/* Both buffers are kept in a userdata so nothing
+	 * leaks if the writer raises an error */
+	out = lua_newuserdata(L, TRANSCODE_SIZE + 32 + p->depth);
+	stack = (signed char *)out + TRANSCODE_SIZE + 32;
+	stack[0] = MODE_DONE;
+
+	s.parts = 0;
+	s.written = 0;
+	s.p = out;
+	start_input(&p->in);
+
+	while ((next_char = p->getchar(L, &p->in)) > 0) {
+		signed char next_class;
+
+		if (next_char >= 126) {
+			next_class = C_ETC;
+		} else {
+			next_class = ascii_class[next_char];
+			if (next_class <= __) {
+				goto syntax_error;
+			}
+		}
+
+again:
+		state = state_transition_table[state][next_class];
+
+		switch (state) {
+		case GO:
+		case OB:
+		case KE:
+		case CO:
+		case VA:
+		case A0:
+		case AR:
+			/* These are only reached by whitespace */
+			if (!minify) {
+				put(&s, next_char);
+			}
+			break;
+
+		case OK:
+			/* ..as is this, except at the end of
+			 * true, false and null */
+			if (minify && next_class <= C_WHITE) {
+				break;
+			}
+		case T1:
+		case T2:
+		case T3:
+		case F1:
+		case F2:
+		case F3:
+		case F4:
+		case N1:
+		case N2:
+		case N3:
+		case MI:
+		case ZE:
+		case IT:
+		case FP:
+		case FR:
+		case E1:
+		case E2:
+		case E3:
+			put(&s, next_char);
+			break;
+
+		case ZN: /* end number */
+			state = OK;
+			goto again;
+
+		case XS: /* begin string */
+			put(&s, '"');
+			state = ST;
+			break;
+
+		case ST:
+			put_string_char(put, &s, next_char, ascii);
+			break;
+
+		case YE: /* put an escaped character */
+			switch (next_char) {
+			case 'b':
+				next_char = '\b';
+				break;
+			case 'f':
+				next_char = '\f';
+				break;
+			case 'n':
+				next_char = '\n';
+				break;
+			case 'r':
+				next_char = '\r';
+				break;
+			case 't':
+				next_char = '\t';
+				break;
+			}
+			put_string_char(put, &s, next_char, ascii);
+			state = ST;
+			break;
+
+		case U1: /* begin escaped unicode character */
+			if (high_sur == 0 && p->getchar == utf8_getchar &&
+					(unicode = fast_unicode(&p->in)) >= 0) {
+				put_string_char(put, &s, unicode, ascii);
+				state = ST;
+			}
+			unicode = 0;
+			break;
+
+		case U3:
+		case U4:
+			unicode <<= 4;
+		case U2:
+			unicode |= hex_value[next_char];
+			break;
+
+		case YU: /* write the escaped unicode character */
+			unicode <<= 4;
+			unicode |= hex_value[next_char];
+			if (unicode >= 0xD800 && unicode < 0xDC00) {
+				high_sur = unicode;
+				state = L1;
+			} else {
+				if (high_sur) {
+					if (unicode < 0xDC00 ||
+							unicode >= 0xE000)
+						goto syntax_error;
+
+					unicode &= 1023;
+					unicode |= (high_sur & 1023) << 10;
+					unicode |= 0x10000;
+					high_sur = 0;
+				} else if (unicode >= 0xDC00 &&
+						unicode < 0xE000) {
+					goto syntax_error;
+				}
+				put_string_char(put, &s, unicode, ascii);
+				state = ST;
+			}
+			unicode = 0;
+			break;
+
+		case ZS: /* end string */
+			put(&s, '"');
+			switch (stack[top]) {
+			case MODE_KEY:
+				state = CO;
+				break;
+			case MODE_ARRAY:
+			case MODE_OBJECT:
+				state = OK;
+				break;
+			default:
+				goto syntax_error;
+			}
+			break;
+
+		case XA: /* begin array */
+			top++;
+			if (top == p->depth) {
+				goto stack_overflow;
+			}
+			stack[top] = MODE_ARRAY;
+			put(&s, '[');
+			state = A0;
+			break;
+
+		case XO: /* begin object */
+			top++;
+			if (top == p->depth) {
+				goto stack_overflow;
+			}
+			stack[top] = MODE_KEY;
+			put(&s, '{');
+			state = OB;
+			break;
+
+		case Z0: /* end empty array */
+		case ZA: /* end array */
+			if (stack[top] != MODE_ARRAY) {
+				goto syntax_error;
+			}
+			put(&s, ']');
+			top--;
+			state = OK;
+			break;
+
+		case ZQ: /* end empty object */
+			if (stack[top] != MODE_KEY) {
+				goto syntax_error;
+			}
+			put(&s, '}');
+			top--;
+			state = OK;
+			break;
+
+		case ZO: /* end object */
+			if (stack[top] != MODE_OBJECT) {
+				goto syntax_error;
+			}
+			put(&s, '}');
+			top--;
+			state = OK;
+			break;
+
+		case YN: /* next key/value pair or array entry */
+			switch (stack[top]) {
+			case MODE_OBJECT:
+				stack[top] = MODE_KEY;
+				state = KE;
+				break;
+			case MODE_ARRAY:
+				state = VA;
+				break;
+			default:
+				goto syntax_error;
+			}
+			put(&s, ',');
+			break;
+
+		case YV: /* key read, now read the value */
+			if (stack[top] != MODE_KEY) {
+				goto syntax_error;
+			}
+			stack[top] = MODE_OBJECT;
+			put(&s, ':');
+			state = VA;
+			break;
+
+		case __: /* bad state */
+			goto syntax_error;
+		}
+
+		if (s.written >= TRANSCODE_SIZE) {
+			flush_output();
+		}
+	}
+
+	if (p->in.failed) {
+		lua_pushvalue(L, p->in.progress_index);
+		return lua_error(L);
+	}
+
+	if (p->in.truncated) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "limit exceeded after %d bytes",
+				(int)p->in.read);
+		return 2;
+	}
+
+	if (next_char < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "encoding error after %d bytes",
+				(int)p->in.read);
+		return 2;
+	}
+
+	if (state != OK || stack[top] != MODE_DONE) {
+		goto syntax_error;
+	}
+
+	if (s.written) {
+		flush_output();
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+
+syntax_error:
+	lua_pushnil(L);
+	lua_pushfstring(L, "syntax error after %d bytes", (int)p->in.read);
+	return 2;
+
+stack_overflow:
+	lua_pushnil(L);
+	lua_pushliteral(L, "stack overflow");
+	return 2;
+}
+
+/*
+ * This is the parse function exported to Lua
+ *
+ * It reads the arguments provided and initialises
+ * the input and the putchar and getchar functions
+ * accordingly before running the parser
+ */
+static int l_parse(lua_State *L)
+{
+	struct parser p;
+	int nargs = lua_gettop(L);
+	int ret;
+
+	ret = open_input(L, &p);
+	if (ret) {
+		return ret;
+	}
+
+	read_options(L, &p, 2 + p.skip, nargs);
+
+	return run_parse(L, &p);
+}
+
+/*
+ * This is the function returned by decoder()
+ */
+static int l_decode(lua_State *L)
+{
+	struct parser p;
+	int ret;
+
+	ret = open_input(L, &p);
+	if (ret) {
+		return ret;
+	}
+
+	lua_pushvalue(L, lua_upvalueindex(2));
+	read_options(L, &p, lua_gettop(L), lua_gettop(L));
+
+	return run_parse(L, &p);
+}
+
+/*
+ * This is the decoder function exported to Lua
+ *
+ * It returns a function which parses documents like parse with
+ * the options given here, so limits are set once for all of them
+ */
+static int l_decoder(lua_State *L)
+{
+	struct parser p;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	/* Keep a copy of the options, so they can't be changed later */
+	lua_newtable(L);
+	lua_pushnil(L);
+	while (lua_next(L, 1)) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, 2);
+	}
+
+	/* Check the options now rather than on first use */
+	read_options(L, &p, 2, 2);
+	lua_settop(L, 2);
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, 2);
+	lua_pushcclosure(L, l_decode, 2);
+	return 1;
+}
+
+/*
+ * This is the parse_into function exported to Lua
+ *
+ * It works like parse, but the document is decoded into the table
+ * given as the first argument, reusing its subtables where the
+ * document has arrays or objects in the same places
+ */
+static int l_parse_into(lua_State *L)
+{
+	struct parser p;
+	int nargs = lua_gettop(L);
+	int ret;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	/* Move the target out of the way of the input */
+	lua_pushvalue(L, 1);
+	lua_remove(L, 1);
+
+	ret = open_input(L, &p);
+	if (ret) {
+		return ret;
+	}
+
+	read_options(L, &p, 2 + p.skip, nargs - 1);
+	if (p.path != NULL) {
+		return luaL_error(L, "bad option 'columns' "
+				"(not supported by parse_into)");
+	}
+	p.target_index = nargs;
+
+	/* The scratch tables are kept between calls, but are left
+	 * in an unknown state if parsing fails, so they're taken
+	 * out while parsing and only put back on success */
+	lua_pushvalue(L, lua_upvalueindex(2));
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+	}
+	p.scratch_index = lua_gettop(L);
+	lua_pushboolean(L, 0);
+	lua_replace(L, lua_upvalueindex(2));
+
+	ret = run_parse(L, &p);
+	if (ret == 1) {
+		lua_pushvalue(L, p.scratch_index);
+		lua_replace(L, lua_upvalueindex(2));
+	}
+
+	return ret;
+}
+
+/*
+ * This is the columns function exported to Lua
+ *
+ * It works like parse, but the array of objects at the path
+ * given as the second argument is decoded into a table with
+ * an array of values for each key
+ */
+static int l_columns(lua_State *L)
+{
+	struct parser p;
+	int nargs = lua_gettop(L);
+	int ret;
+
+	ret = open_input(L, &p);
+	if (ret) {
+		return ret;
+	}
+
+	read_options(L, &p, 3 + p.skip, nargs);
+	read_path(L, &p, 2 + p.skip, NULL);
+
+	return run_parse(L, &p);
+}
+
+/*
+ * This is the each function exported to Lua
+ *
+ * It parses the document like parse, but every value at the path
+ * given as the second argument is passed to the callback given
+ * as the third argument as soon as it is read, and is then
+ * dropped rather than stored in the document.
+ * Returns the number of values found
+ */
+static int l_each(lua_State *L)
+{
+	struct parser p;
+	int nargs = lua_gettop(L);
+	int ret;
+
+	ret = open_input(L, &p);
+	if (ret) {
+		return ret;
+	}
+
+	luaL_checktype(L, 3 + p.skip, LUA_TFUNCTION);
+	read_options(L, &p, 4 + p.skip, nargs);
+
+	p.each = compile_path(L, 2 + p.skip);
+	if (p.each == NULL) {
+		return luaL_argerror(L, 2 + p.skip, "invalid path");
+	}
+	p.each_index = 3 + p.skip;
+
+	return run_parse(L, &p);
+}
+
+/*
+ * This is the transcode function exported to Lua
+ *
+ * It validates the document and writes it again to the function
+ * given as the second argument without building any Lua values
+ */
+static int l_transcode(lua_State *L)
+{
+	struct parser p;
+	int nargs = lua_gettop(L);
+	int minify = 0;
+	int ascii = 0;
+	int ret;
+
+	ret = open_input(L, &p);
+	if (ret) {
+		return ret;
+	}
+
+	luaL_checktype(L, 2 + p.skip, LUA_TFUNCTION);
+	read_options(L, &p, 3 + p.skip, nargs);
+	if (nargs >= 3 + p.skip && lua_istable(L, 3 + p.skip)) {
+		lua_getfield(L, 3 + p.skip, "minify");
+		minify = lua_toboolean(L, -1);
+		lua_getfield(L, 3 + p.skip, "ascii");
+		ascii = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+
+	return transcode(L, &p, 2 + p.skip, minify, ascii);
+}
+
+/*
+ * This is the parsefd function exported to Lua
+ *
+ * It works like parse, but reads the document from the file
+ * descriptor or file handle given as the first argument in
+ * a background thread while the parser works
+ */
+static int l_parsefd(lua_State *L)
+{
+	struct parser p;
+	struct reader *r;
+	int nargs = lua_gettop(L);
+	int fd;
+	int ret;
+
+	if (lua_type(L, 1) == LUA_TNUMBER) {
+		fd = (int)lua_tointeger(L, 1);
+	} else {
+		FILE **f = lua_touserdata(L, 1);
+		int file = 0;
+
+		if (f != NULL && lua_getmetatable(L, 1)) {
+			lua_getfield(L, LUA_REGISTRYINDEX, LUA_FILEHANDLE);
+			file = lua_rawequal(L, -1, -2);
+			lua_pop(L, 2);
+		}
+		if (!file) {
+			return luaL_argerror(L, 1,
+				"expected file descriptor or file handle");
+		}
+		if (*f == NULL) {
+			return luaL_argerror(L, 1,
+				"attempt to use a closed file");
+		}
+		fd = fileno(*f);
+	}
+
+	read_options(L, &p, 2, nargs);
+
+	r = lua_newuserdata(L, sizeof(struct reader));
+	r->fd = fd;
+	r->head = 0;
+	r->tail = 0;
+	r->stop = 0;
+	r->error = 0;
+	r->running = 0;
+	r->busy = 0;
+	r->eof = 0;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->filled, NULL);
+	pthread_cond_init(&r->freed, NULL);
+	luaL_getmetatable(L, READER_MT);
+	lua_setmetatable(L, -2);
+
+	if (pthread_create(&r->thread, NULL, reader_thread, r)) {
+		return luaL_error(L, "error creating thread");
+	}
+	r->running = 1;
+
+	p.in.read = 0;
+	p.in.string_index = 0;
+	p.in.reader = r;
+	if (reader_getchunk(r, &p.in)) {
+		ret = 0;
+	} else {
+		p.getchar = detect_encoding(&p.in);
+		ret = run_parse(L, &p);
+	}
+	reader_stop(r);
+
+	if (r->error) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "error reading after %d bytes (%s)",
+				(int)p.in.read, strerror(r->error));
+		return 2;
+	}
+	if (ret == 0) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "string too short");
+		return 2;
+	}
+
+	return ret;
+}
+
+/*
+ * This is MurmurHash3 (x86, 32 bit) by Austin Appleby
+ * used to look up documents in the cache
+ */
+#define rotl32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+static unsigned int hash_bytes(const unsigned char *p, size_t len)
+{
+	const unsigned int c1 = 0xcc9e2d51;
+	const unsigned int c2 = 0x1b873593;
+	unsigned int h = (unsigned int)len;
+	unsigned int k;
+	size_t i;
+
+	for (i = len / 4; i > 0; i--) {
+		memcpy(&k, p, 4);
+		p += 4;
+
+		k *= c1;
+		k = rotl32(k, 15);
+		k *= c2;
+
+		h ^= k;
+		h = rotl32(h, 13);
+		h = h * 5 + 0xe6546b64;
+	}
+
+	k = 0;
+	switch (len & 3) {
+	case 3:
+		k ^= p[2] << 16;
+	case 2:
+		k ^= p[1] << 8;
+	case 1:
+		k ^= p[0];
+		k *= c1;
+		k = rotl32(k, 15);
+		k *= c2;
+		h ^= k;
+	}
+
+	h ^= (unsigned int)len;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+#define CACHE_MT "voorhees.cache"
+#define READONLY_MT "voorhees.readonly"
+#define CACHE_BUCKETS 256
+#define DEFAULT_CACHE_ENTRIES 64
+#define DEFAULT_CACHE_BYTES (32 * 1024 * 1024)
+
+/*
+ * A cached document. The source text and the parsed
+ * result are referenced from the table of references
+ */
+struct cache_entry {
+	struct cache_entry *next;
+	struct cache_entry *newer;
+	struct cache_entry *older;
+	unsigned int hash;
+	size_t len;
+	int source;
+	int result;
+};
+
+/*
+ * The cache is a hash table of entries
+ * which are also kept in LRU order
+ */
+struct cache {
+	struct cache_entry *buckets[CACHE_BUCKETS];
+	struct cache_entry *newest;
+	struct cache_entry *oldest;
+	unsigned int entries;
+	unsigned int max_entries;
+	size_t bytes;
+	size_t max_bytes;
+	int shared;
+};
+
+/*
+ * Remove an entry from the LRU list
+ */
+static void cache_unlink(struct cache *c, struct cache_entry *e)
+{
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		c->newest = e->older;
+
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		c->oldest = e->newer;
+}
+
+/*
+ * Insert an entry as the newest in the LRU list
+ */
+static void cache_link(struct cache *c, struct cache_entry *e)
+{
+	e->newer = NULL;
+	e->older = c->newest;
+	if (c->newest)
+		c->newest->newer = e;
+	else
+		c->oldest = e;
+	c->newest = e;
+}
+
+/*
+ * Evict the oldest entries until the cache is within its limits.
+ * refs is the stack index of the table of references
+ */
+static void cache_evict(lua_State *L, struct cache *c, int refs)
+{
+	while (c->oldest != NULL && (c->entries > c->max_entries ||
+				c->bytes > c->max_bytes)) {
+		struct cache_entry *e = c->oldest;
+		struct cache_entry **b = &c->buckets[e->hash % CACHE_BUCKETS];
+
+		while (*b != e)
+			b = &(*b)->next;
+		*b = e->next;
+
+		cache_unlink(c, e);
+		luaL_unref(L, refs, e->source);
+		luaL_unref(L, refs, e->result);
+		c->entries--;
+		c->bytes -= e->len;
+		free(e);
+	}
+}
+
+static int cache_gc(lua_State *L)
+{
+	struct cache *c = luaL_checkudata(L, 1, CACHE_MT);
+
+	while (c->oldest != NULL) {
+		struct cache_entry *e = c->oldest;
+
+		c->oldest = e->newer;
+		free(e);
+	}
+	c->newest = NULL;
+	c->entries = 0;
+	c->bytes = 0;
+	return 0;
+}
+
+/*
+ * This function pushes a deep copy of the table at index idx.
+ * Other values, including vectors which can't be changed and
+ * the null value at index null_index, are shared with the original
+ */
+static void copy_table(lua_State *L, int idx, int null_index)
+{
+	int narr = (int)lua_objlen(L, idx);
+	int n = 0;
+
+	luaL_checkstack(L, 4, "out of memory");
+
+	/* Count the entries so the copy can be created
+	 * with the right size */
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		lua_pop(L, 1);
+		n++;
+	}
+
+	lua_createtable(L, narr, n - narr);
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		if (lua_istable(L, -1) && !lua_rawequal(L, -1, null_index)) {
+			copy_table(L, lua_gettop(L), null_index);
+			lua_replace(L, -2);
+		}
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -4);
+	}
+}
+
+static int readonly_newindex(lua_State *L)
+{
+	return luaL_error(L, "cached documents are read-only");
+}
+
+/*
+ * This function makes the table at index idx and the tables in it,
+ * except the null value at index null_index, read-only. Adding keys
+ * to them raises an error and their metatable can't be changed
+ */
+static void seal_table(lua_State *L, int idx, int null_index)
+{
+	luaL_checkstack(L, 3, "out of memory");
+
+	luaL_getmetatable(L, READONLY_MT);
+	lua_setmetatable(L, idx);
+
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		if (lua_istable(L, -1) && !lua_rawequal(L, -1, null_index)) {
+			seal_table(L, lua_gettop(L), null_index);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * This is the parser function returned by voorhees.cache()
+ *
+ * Upvalues are the null value, the options table,
+ * the cache and the table of references
+ */
+static int l_cached(lua_State *L)
+{
+	struct parser p;
+	struct cache *c = lua_touserdata(L, lua_upvalueindex(3));
+	struct cache_entry *e = NULL;
+	const char *str = NULL;
+	size_t len = 0;
+	unsigned int hash = 0;
+	int refs = lua_upvalueindex(4);
+	int ret;
+
+	/* Keep the length following a pointer */
+	lua_settop(L, 2);
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		str = lua_tolstring(L, 1, &len);
+		hash = hash_bytes((const unsigned char *)str, len);
+
+		for (e = c->buckets[hash % CACHE_BUCKETS]; e; e = e->next) {
+			const char *cached;
+
+			if (e->hash != hash || e->len != len)
+				continue;
+
+			/* Identical strings are often the same object */
+			lua_rawgeti(L, refs, e->source);
+			cached = lua_tostring(L, -1);
+			lua_pop(L, 1);
+			if (cached == str || memcmp(cached, str, len) == 0)
+				break;
+		}
+	}
+
+	if (e != NULL) {
+		/* Hit, so make it the newest entry */
+		cache_unlink(c, e);
+		cache_link(c, e);
+
+		lua_rawgeti(L, refs, e->result);
+	} else {
+		/* Miss, so parse the document and cache it
+		 * if it is a string and not too big */
+		ret = open_input(L, &p);
+		if (ret) {
+			return ret;
+		}
+
+		lua_pushvalue(L, lua_upvalueindex(2));
+		read_options(L, &p, lua_gettop(L), lua_gettop(L));
+
+		ret = run_parse(L, &p);
+		if (ret != 1) {
+			return ret;
+		}
+
+		if (str == NULL || len > c->max_bytes) {
+			return 1;
+		}
+
+		if (c->shared && lua_istable(L, -1)) {
+			seal_table(L, lua_gettop(L), p.null_index);
+		}
+
+		e = malloc(sizeof(struct cache_entry));
+		if (e == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+
+		e->hash = hash;
+		e->len = len;
+		lua_pushvalue(L, 1);
+		e->source = luaL_ref(L, refs);
+		lua_pushvalue(L, -1);
+		e->result = luaL_ref(L, refs);
+
+		e->next = c->buckets[hash % CACHE_BUCKETS];
+		c->buckets[hash % CACHE_BUCKETS] = e;
+		cache_link(c, e);
+		c->entries++;
+		c->bytes += len;
+
+		cache_evict(L, c, refs);
+	}
+
+	/* Unless results are shared the cached
+	 * result must never be handed out */
+	if (!c->shared && lua_istable(L, -1)) {
+		lua_getfield(L, lua_upvalueindex(2), "null");
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, lua_upvalueindex(1));
+		}
+		copy_table(L, lua_gettop(L) - 1, lua_gettop(L));
+	}
+
+	return 1;
+}
+
+/*
+ * This is the cache function exported to Lua
+ *
+ * It takes a table of options, which are the options of
+ * parse() and the size of the cache, and returns a parser
+ * which caches the results of parsing string documents
+ */
+static int l_cache(lua_State *L)
+{
+	struct parser p;
+	struct cache *c;
+	lua_Number n;
+
+	lua_settop(L, 1);
+	if (lua_isnil(L, 1)) {
+		lua_newtable(L);
+		lua_replace(L, 1);
+	}
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	/* Check the parser options now rather than on first use */
+	read_options(L, &p, 1, 1);
+	lua_settop(L, 1);
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, 1);
+
+	c = lua_newuserdata(L, sizeof(struct cache));
+	memset(c, 0, sizeof(struct cache));
+	luaL_getmetatable(L, CACHE_MT);
+	lua_setmetatable(L, -2);
+
+	lua_getfield(L, 1, "entries");
+	n = lua_isnil(L, -1) ? DEFAULT_CACHE_ENTRIES : lua_tonumber(L, -1);
+	if (n < 1) {
+		return option_error(L, 1, "entries",
+				"entries must be 1 or greater");
+	}
+	c->max_entries = (unsigned int)n;
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "bytes");
+	n = lua_isnil(L, -1) ? DEFAULT_CACHE_BYTES : lua_tonumber(L, -1);
+	if (n < 0) {
+		return option_error(L, 1, "bytes",
+				"bytes must be 0 or greater");
+	}
+	c->max_bytes = (size_t)n;
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "shared");
+	c->shared = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	lua_pushcclosure(L, l_cached, 4);
+	return 1;
+}
+
+/*
+ * These are the methods of vectors
+ */
+static int vector_len(lua_State *L)
+{
+	struct vector *v = luaL_checkudata(L, 1, VECTOR_MT);
+
+	lua_pushnumber(L, (lua_Number)v->n);
+	return 1;
+}
+
+static int vector_index(lua_State *L)
+{
+	struct vector *v = luaL_checkudata(L, 1, VECTOR_MT);
+
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		lua_Number i = lua_tonumber(L, 2);
+
+		if (i >= 1 && i <= v->n && i == (size_t)i) {
+			lua_pushnumber(L, v->v[(size_t)i - 1]);
+		} else {
+			lua_pushnil(L);
+		}
+		return 1;
+	}
+
+	/* Look up methods in the metatable */
+	lua_getmetatable(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	return 1;
+}
+
+static int vector_next(lua_State *L)
+{
+	struct vector *v = luaL_checkudata(L, 1, VECTOR_MT);
+	size_t i = (size_t)luaL_checknumber(L, 2);
+
+	if (i >= v->n) {
+		return 0;
+	}
+
+	lua_pushnumber(L, (lua_Number)(i + 1));
+	lua_pushnumber(L, v->v[i]);
+	return 2;
+}
+
+static int vector_ipairs(lua_State *L)
+{
+	luaL_checkudata(L, 1, VECTOR_MT);
+	lua_pushcfunction(L, vector_next);
+	lua_pushvalue(L, 1);
+	lua_pushnumber(L, 0);
+	return 3;
+}
+
+static int vector_sum(lua_State *L)
+{
+	struct vector *v = luaL_checkudata(L, 1, VECTOR_MT);
+	double sum = 0;
+	size_t i;
+
+	for (i = 0; i < v->n; i++) {
+		sum += v->v[i];
+	}
+
+	lua_pushnumber(L, sum);
+	return 1;
+}
+
+static int vector_min(lua_State *L)
+{
+	struct vector *v = luaL_checkudata(L, 1, VECTOR_MT);
+	double min = v->v[0];
+	size_t i;
+
+	for (i = 1; i < v->n; i++) {
+		if (v->v[i] < min)
+			min = v->v[i];
+	}
+
+	lua_pushnumber(L, min);
+	return 1;
+}
+
+static int vector_max(lua_State *L)
+{
+	struct vector *v = luaL_checkudata(L, 1, VECTOR_MT);
+	double max = v->v[0];
+	size_t i;
+
+	for (i = 1; i < v->n; i++) {
+		if (v->v[i] > max)
+			max = v->v[i];
+	}
+
+	lua_pushnumber(L, max);
+	return 1;
+}
+
+/*
+ * Returns the elements from i to j as a table.
+ * Negative indices count from the end like string.sub()
+ */
+static int vector_slice(lua_State *L)
+{
+	struct vector *v = luaL_checkudata(L, 1, VECTOR_MT);
+	lua_Number n = (lua_Number)v->n;
+	lua_Number i = luaL_optnumber(L, 2, 1);
+	lua_Number j = luaL_optnumber(L, 3, n);
+	size_t k;
+
+	if (i < 0)
+		i += n + 1;
+	if (j < 0)
+		j += n + 1;
+	if (i < 1)
+		i = 1;
+	if (j > n)
+		j = n;
+
+	if (i > j) {
+		lua_newtable(L);
+		return 1;
+	}
+
+	lua_createtable(L, (int)(j - i + 1), 0);
+	for (k = (size_t)i; k <= (size_t)j; k++) {
+		lua_pushnumber(L, v->v[k - 1]);
+		lua_rawseti(L, -2, (int)(k - (size_t)i + 1));
+	}
+	return 1;
+}
+
+static int vector_tostring(lua_State *L)
+{
+	struct vector *v = luaL_checkudata(L, 1, VECTOR_MT);
+
+	lua_pushfstring(L, "vector (%d): %p", (int)v->n, (void *)v);
+	return 1;
+}
+
+static const luaL_Reg vector_methods[] = {
+	{ "__len",      vector_len },
+	{ "__index",    vector_index },
+	{ "__ipairs",   vector_ipairs },
+	{ "__tostring", vector_tostring },
+	{ "ipairs",     vector_ipairs },
+	{ "sum",        vector_sum },
+	{ "min",        vector_min },
+	{ "max",        vector_max },
+	{ "slice",      vector_slice },
+	{ "totable",    vector_slice },
+	{ NULL,         NULL }
+};
+
+/*
+ * Make room for at least n more entries on the tape
+ */
+static int tape_grow_entries(voorhees_tape *t, unsigned int n)
+{
+	voorhees_entry *entries;
+	unsigned int size = t->entries_size ? t->entries_size : 256;
+
+	if (t->nentries + n <= t->entries_size)
+		return 0;
+
+	while (size < t->nentries + n)
+		size *= 2;
+
+	entries = realloc(t->entries, size * sizeof(voorhees_entry));
+	if (entries == NULL)
+		return -1;
+
+	t->entries = entries;
+	t->entries_size = size;
+	return 0;
+}
+
+/*
+ * Make room for at least one more number
+ */
+static int tape_grow_numbers(voorhees_tape *t)
+{
+	double *numbers;
+	unsigned int size = t->numbers_size ? 2 * t->numbers_size : 64;
+
+	if (t->nnumbers < t->numbers_size)
+		return 0;
+
+	numbers = realloc(t->numbers, size * sizeof(double));
+	if (numbers == NULL)
+		return -1;
+
+	t->numbers = numbers;
+	t->numbers_size = size;
+	return 0;
+}
+
+/*
+ * Make room for at least n more bytes in the string arena
+ */
+static int tape_grow_strings(voorhees_tape *t, size_t n)
+{
+	char *strings;
+	size_t size = t->strings_size ? t->strings_size : STRBUF_SIZE;
+
+	if (t->nstrings + n <= t->strings_size)
+		return 0;
+
+	while (size < t->nstrings + n)
+		size *= 2;
+
+	strings = realloc(t->strings, size);
+	if (strings == NULL)
+		return -1;
+
+	t->strings = strings;
+	t->strings_size = size;
+	return 0;
+}
+
+/*
+ * This macro moves the contents of the string buffer
+ * to the end of the string arena
+ */
+#define tape_flush_buffer() \
+	if (tape_grow_strings(t, s.written)) \
+		goto out_of_memory; \
+	memcpy(t->strings + t->nstrings, s.base, s.written); \
+	t->nstrings += s.written; \
+	s.written = 0; \
+	s.p = s.base
+
+/*
+ * This macro appends an entry to the tape
+ */
+#define tape_push(type, value) \
+	if (t->nentries == t->entries_size && tape_grow_entries(t, 1)) \
+		goto out_of_memory; \
+	t->entries[t->nentries].tag = (type); \
+	t->entries[t->nentries].data = (value); \
+	t->nentries++
+
+/*
+ * This macro counts one more element of the innermost container
+ */
+#define tape_count() \
+	if (t->entries[open[top]].tag >= ~0U - (1U << VOORHEES_SHIFT)) \
+		goto too_big; \
+	t->entries[open[top]].tag += 1U << VOORHEES_SHIFT
+
+/*
+ * This is the plain C parse function
+ *
+ * It is driven by the same state transition table as
+ * l_parse(), but writes the document to a tape rather than
+ * building Lua tables. Strings in an UTF-8 encoded source
+ * are only copied to the arena if they contain escapes
+ */
+VOORHEES_API int voorhees_tape_parse(voorhees_tape *t,
+		const char *source, size_t len, unsigned int depth)
+{
+	struct input in;
+	struct strbuf s;
+	int next_char;
+	signed char *stack;
+	unsigned int *open;
+	unsigned int top = 0;
+	signed char state = GO;
+	int high_sur = 0;
+	int unicode = 0;
+	int ret = VOORHEES_OK;
+	const unsigned char *start = NULL;
+	size_t mark = 0;
+	getchar_func getchar;
+
+	t->nentries = 0;
+	t->nnumbers = 0;
+	t->nstrings = 0;
+	t->source = source;
+	t->read = 0;
+
+	if (len < 2)
+		return VOORHEES_ESYNTAX;
+	if (len > ~0U)
+		return VOORHEES_ETOOBIG;
+
+	if (depth == 0)
+		depth = DEFAULT_DEPTH;
+
+	in.p = (const unsigned char *)source;
+	in.len = len;
+	in.read = 0;
+	in.string_index = 0;
+	in.reader = NULL;
+	in.checkpoint = 0;
+	in.held = 0;
+
+	getchar = detect_encoding(&in);
+
+	stack = malloc(depth);
+	open = malloc(depth * sizeof(unsigned int));
+	if (stack == NULL || open == NULL) {
+		free(stack);
+		free(open);
+		return VOORHEES_ENOMEM;
+	}
+	stack[0] = MODE_DONE;
+
+	s.parts = 0;
+	s.written = 0;
+	s.p = s.base;
+
+	/* The getchar functions only use the Lua state
+	 * to run the generator, so it is not needed here */
+	while ((next_char = getchar(NULL, &in)) > 0) {
+		signed char next_class;
+
+		if (next_char >= 126) {
+			next_class = C_ETC;
+		} else {
+			next_class = ascii_class[next_char];
+			if (next_class <= __) {
+				goto syntax_error;
+			}
+		}
+
+again:
+		state = state_transition_table[state][next_class];
+
+		switch (state) {
+		case N1:
+			tape_push(VOORHEES_NULL, 0);
+			break;
+
+		case T1:
+			tape_push(VOORHEES_TRUE, 0);
+			break;
+
+		case F1:
+			tape_push(VOORHEES_FALSE, 0);
+			break;
+
+		case MI:
+		case ZE:
+		case IT:
+		case FP:
+		case FR:
+		case E1:
+		case E2:
+		case E3:
+			*s.p++ = (char)next_char;
+			s.written++;
+			if (s.written == STRBUF_SIZE) {
+				tape_flush_buffer();
+			}
+			break;
+
+		case XS: /* begin string */
+			/* Strings in UTF-8 sources are left in
+			 * place until we meet an escape */
+			if (getchar == utf8_getchar) {
+				start = in.p;
+			}
+			state = ST;
+			break;
+
+		case ST:
+			if (start == NULL) {
+				utf8_putchar(&s, next_char);
+				if (s.written >= (STRBUF_SIZE - 4)) {
+					tape_flush_buffer();
+				}
+			}
+			break;
+
+		case ES: /* begin escape */
+			if (start != NULL) {
+				size_t n = in.p - 1 - start;
+
+				if (tape_grow_strings(t, n)) {
+					goto out_of_memory;
+				}
+				memcpy(t->strings + t->nstrings, start, n);
+				t->nstrings += n;
+				start = NULL;
+			}
+			break;
+
+		case YE: /* put an escaped character */
+			switch (next_char) {
+			case 'b':
+				utf8_putchar(&s, '\b');
+				break;
+			case 'f':
+				utf8_putchar(&s, '\f');
+				break;
+			case 'n':
+				utf8_putchar(&s, '\n');
+				break;
+			case 'r':
+				utf8_putchar(&s, '\r');
+				break;
+			case 't':
+				utf8_putchar(&s, '\t');
+				break;
+			default:
+				utf8_putchar(&s, next_char);
+			}
+			if (s.written >= (STRBUF_SIZE - 4)) {
+				tape_flush_buffer();
+			}
+			state = ST;
+			break;
+
+		case U1:
+			if (high_sur == 0 && getchar == utf8_getchar &&
+					(unicode = fast_unicode(&in)) >= 0) {
+				utf8_putchar(&s, unicode);
+				if (s.written >= (STRBUF_SIZE - 4)) {
+					tape_flush_buffer();
+				}
+				state = ST;
+			}
+			unicode = 0;
+			break;
+
+		case U3:
+		case U4:
+			unicode <<= 4;
+		case U2:
+			if (next_char <= '9') {
+				unicode |= (next_char - '0');
+			} else if (next_char <= 'F') {
+				unicode |= next_char - 55;
+			} else {
+				unicode |= next_char - 87;
+			}
+			break;
+
+		case YU: /* write the escaped unicode character */
+			unicode <<= 4;
+			if (next_char <= '9') {
+				unicode |= next_char - '0';
+			} else if (next_char <= 'F') {
+				unicode |= next_char - 55;
+			} else {
+				unicode |= next_char - 87;
+			}
+			if (unicode >= 0xD800 && unicode < 0xDC00) {
+				high_sur = unicode;
+				state = L1;
+			} else {
+				if (high_sur) {
+					if (unicode < 0xDC00 ||
+							unicode >= 0xE000)
+						goto syntax_error;
+
+					unicode &= 1023;
+					unicode |= (high_sur & 1023) << 10;
+					unicode |= 0x10000;
+					high_sur = 0;
+				} else if (unicode >= 0xDC00 &&
+						unicode < 0xE000) {
+					goto syntax_error;
+				}
+				utf8_putchar(&s, unicode);
+				if (s.written >= (STRBUF_SIZE - 4)) {
+					tape_flush_buffer();
+				}
+				state = ST;
+			}
+			unicode = 0;
+			break;
+
+		case XA: /* begin array */
+			top++;
+			if (top == depth) {
+				goto stack_overflow;
+			}
+			stack[top] = MODE_ARRAY;
+			open[top] = t->nentries;
+			tape_push(VOORHEES_ARRAY, 0);
+			state = A0;
+			break;
+
+		case XO: /* begin object */
+			top++;
+			if (top == depth) {
+				goto stack_overflow;
+			}
+			stack[top] = MODE_KEY;
+			open[top] = t->nentries;
+			tape_push(VOORHEES_OBJECT, 0);
+			state = OB;
+			break;
+
+		case ZN: /* end number */
+			/* Numbers are converted from the end of the
+			 * arena which is then rewound */
+			tape_flush_buffer();
+			if (tape_grow_strings(t, 1) || tape_grow_numbers(t)) {
+				goto out_of_memory;
+			}
+			t->strings[t->nstrings] = '\0';
+			t->numbers[t->nnumbers] = strtod(t->strings + mark, NULL);
+			t->nstrings = mark;
+			tape_push(VOORHEES_NUMBER, t->nnumbers);
+			t->nnumbers++;
+			state = OK;
+			goto again;
+
+		case ZS: /* end string */
+			if (start != NULL) {
+				size_t n = in.p - 1 - start;
+
+				if (n >= (1U << (32 - VOORHEES_SHIFT))) {
+					goto too_big;
+				}
+				tape_push(VOORHEES_STRING | VOORHEES_INSOURCE |
+						((unsigned int)n << VOORHEES_SHIFT),
+						(const char *)start - source);
+				start = NULL;
+			} else {
+				size_t n;
+
+				tape_flush_buffer();
+				n = t->nstrings - mark;
+				if (n >= (1U << (32 - VOORHEES_SHIFT)) ||
+						mark > ~0U) {
+					goto too_big;
+				}
+				tape_push(VOORHEES_STRING |
+						((unsigned int)n << VOORHEES_SHIFT),
+						mark);
+				mark = t->nstrings;
+			}
+			switch (stack[top]) {
+			case MODE_KEY:
+				state = CO;
+				break;
+			case MODE_ARRAY:
+			case MODE_OBJECT:
+				state = OK;
+				break;
+			default:
+				goto syntax_error;
+			}
+			break;
+
+		case Z0: /* end empty array */
+			if (stack[top] != MODE_ARRAY) {
+				goto syntax_error;
+			}
+			t->entries[open[top]].data = t->nentries;
+			top--;
+			state = OK;
+			break;
+
+		case ZA: /* end array */
+			if (stack[top] != MODE_ARRAY) {
+				goto syntax_error;
+			}
+			tape_count();
+			t->entries[open[top]].data = t->nentries;
+			top--;
+			state = OK;
+			break;
+
+		case ZQ: /* end empty object */
+			if (stack[top] != MODE_KEY) {
+				goto syntax_error;
+			}
+			t->entries[open[top]].data = t->nentries;
+			top--;
+			state = OK;
+			break;
+
+		case ZO: /* end object */
+			if (stack[top] != MODE_OBJECT) {
+				goto syntax_error;
+			}
+			tape_count();
+			t->entries[open[top]].data = t->nentries;
+			top--;
+			state = OK;
+			break;
+
+		case YN: /* next key/value pair or array entry */
+			switch (stack[top]) {
+			case MODE_OBJECT:
+				stack[top] = MODE_KEY;
+				tape_count();
+				state = KE;
+				break;
+			case MODE_ARRAY:
+				tape_count();
+				state = VA;
+				break;
+			default:
+				goto syntax_error;
+			}
+			break;
+
+		case YV: /* key read, now read the value */
+			if (stack[top] != MODE_KEY) {
+				goto syntax_error;
+			}
+			stack[top] = MODE_OBJECT;
+			state = VA;
+			break;
+
+		case __: /* bad state */
+			goto syntax_error;
+		}
+	}
+
+	if (next_char < 0) {
+		ret = VOORHEES_EENCODING;
+	} else if (state != OK || stack[top] != MODE_DONE) {
+		ret = VOORHEES_ESYNTAX;
+	}
+	goto out;
+
+syntax_error:
+	ret = VOORHEES_ESYNTAX;
+	goto out;
+
+stack_overflow:
+	ret = VOORHEES_EDEPTH;
+	goto out;
+
+out_of_memory:
+	ret = VOORHEES_ENOMEM;
+	goto out;
+
+too_big:
+	ret = VOORHEES_ETOOBIG;
+
+out:
+	t->read = in.read;
+	free(stack);
+	free(open);
+	return ret;
+}
+
+/*
+ * Free the memory used by a tape
+ */
+VOORHEES_API void voorhees_tape_free(voorhees_tape *t)
+{
+	free(t->entries);
+	free(t->numbers);
+	free(t->strings);
+	memset(t, 0, sizeof(voorhees_tape));
+}
+
+/*
+ * Snapshots are tapes written to a file by compile() with all
+ * strings moved to the string arena. The file starts with this
+ * header, followed by the entries, the numbers and the strings.
+ * Snapshots are only read on machines with the same byte order
+ */
+#define SNAPSHOT_MAGIC "VRHS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ORDER 0x01020304
+
+struct snapshot_header {
+	char magic[4];
+	unsigned int version;
+	unsigned int order;
+	unsigned int nentries;
+	unsigned int nnumbers;
+	unsigned int nstrings;
+	unsigned int reserved[2];
+};
+
+/*
+ * This function writes the tape t to the file f.
+ * Returns 0 on success, -1 if writing fails or
+ * VOORHEES_ETOOBIG if the strings don't fit
+ */
+static int write_snapshot(FILE *f, const voorhees_tape *t)
+{
+	struct snapshot_header h;
+	size_t nstrings = t->nstrings;
+	unsigned int i;
+
+	/* Strings left in the source are placed after the arena */
+	for (i = 0; i < t->nentries; i++) {
+		if (t->entries[i].tag & VOORHEES_INSOURCE)
+			nstrings += t->entries[i].tag >> VOORHEES_SHIFT;
+	}
+	if (nstrings > ~0U)
+		return VOORHEES_ETOOBIG;
+
+	memcpy(h.magic, SNAPSHOT_MAGIC, 4);
+	h.version = SNAPSHOT_VERSION;
+	h.order = SNAPSHOT_ORDER;
+	h.nentries = t->nentries;
+	h.nnumbers = t->nnumbers;
+	h.nstrings = (unsigned int)nstrings;
+	h.reserved[0] = 0;
+	h.reserved[1] = 0;
+
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		return -1;
+
+	nstrings = t->nstrings;
+	for (i = 0; i < t->nentries; i++) {
+		voorhees_entry e = t->entries[i];
+
+		if (e.tag & VOORHEES_INSOURCE) {
+			e.tag &= ~VOORHEES_INSOURCE;
+			e.data = (unsigned int)nstrings;
+			nstrings += e.tag >> VOORHEES_SHIFT;
+		}
+		if (fwrite(&e, sizeof(e), 1, f) != 1)
+			return -1;
+	}
+
+	if (fwrite(t->numbers, sizeof(double), t->nnumbers, f) != t->nnumbers ||
+			fwrite(t->strings, 1, t->nstrings, f) != t->nstrings)
+		return -1;
+
+	for (i = 0; i < t->nentries; i++) {
+		const voorhees_entry *e = &t->entries[i];
+		size_t len = e->tag >> VOORHEES_SHIFT;
+
+		if ((e->tag & VOORHEES_INSOURCE) &&
+				fwrite(t->source + e->data, 1, len, f) != len)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Pushes the message of a tape error code and returns 2
+ */
+static int tape_error(lua_State *L, const voorhees_tape *t, int err)
+{
+	lua_pushnil(L);
+	switch (err) {
+	case VOORHEES_ESYNTAX:
+		lua_pushfstring(L, "syntax error after %d bytes",
+				(int)t->read);
+		break;
+	case VOORHEES_EENCODING:
+		lua_pushfstring(L, "encoding error after %d bytes",
+				(int)t->read);
+		break;
+	case VOORHEES_EDEPTH:
+		lua_pushliteral(L, "stack overflow");
+		break;
+	case VOORHEES_ENOMEM:
+		lua_pushliteral(L, "out of memory");
+		break;
+	default:
+		lua_pushliteral(L, "document too big");
+	}
+	return 2;
+}
+
+/*
+ * This is the compile function exported to Lua
+ *
+ * It parses the string given as the first argument into a tape
+ * and writes it as a snapshot to the file named by the second
+ */
+static int l_compile(lua_State *L)
+{
+	struct parser p;
+	voorhees_tape t;
+	const char *source;
+	const char *path;
+	size_t len;
+	FILE *f;
+	int err;
+
+	source = to_buffer(L, 1, &len, &p.skip);
+	if (source == NULL) {
+		return luaL_argerror(L, 1, "expected string or buffer");
+	}
+	path = luaL_checkstring(L, 2 + p.skip);
+	read_options(L, &p, 3 + p.skip, lua_gettop(L));
+
+	memset(&t, 0, sizeof(t));
+	err = voorhees_tape_parse(&t, source, len, p.depth);
+	if (err) {
+		err = tape_error(L, &t, err);
+		voorhees_tape_free(&t);
+		return err;
+	}
+
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		voorhees_tape_free(&t);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+
+	err = write_snapshot(f, &t);
+	voorhees_tape_free(&t);
+	if (fclose(f) && err == 0) {
+		err = -1;
+	}
+	if (err > 0) {
+		remove(path);
+		return tape_error(L, &t, err);
+	}
+	if (err) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		remove(path);
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * The mapping of a snapshot file is kept in a userdata
+ * so it is unmapped even if building the document fails
+ */
+#define MAPPING_MT "voorhees.mapping"
+
+struct mapping {
+	void *p;
+	size_t len;
+};
+
+static int mapping_gc(lua_State *L)
+{
+	struct mapping *m = lua_touserdata(L, 1);
+
+	if (m->p != NULL) {
+		munmap(m->p, m->len);
+		m->p = NULL;
+	}
+	return 0;
+}
+
+/*
+ * A snapshot mapped into memory by load()
+ */
+struct snapshot {
+	const voorhees_entry *entries;
+	unsigned int nentries;
+	const double *numbers;
+	unsigned int nnumbers;
+	const char *strings;
+	unsigned int nstrings;
+	int null_index;
+	/* Set if the document is nested too deep */
+	int overflow;
+};
+
+/*
+ * This function pushes the value of entry i of the snapshot nesting
+ * at most depth arrays and objects. Everything read from the file is
+ * checked, so a corrupt snapshot can't make us read outside of it.
+ * Returns the index of the entry after the value or 0 if the
+ * snapshot is corrupt
+ */
+static unsigned int load_value(lua_State *L, struct snapshot *sn,
+		unsigned int i, unsigned int depth)
+{
+	unsigned int tag;
+	unsigned int data;
+	unsigned int n;
+	unsigned int k;
+
+	if (i >= sn->nentries)
+		return 0;
+
+	tag = sn->entries[i].tag;
+	data = sn->entries[i].data;
+	n = tag >> VOORHEES_SHIFT;
+
+	switch (tag & VOORHEES_TYPEMASK) {
+	case VOORHEES_NULL:
+		lua_pushvalue(L, sn->null_index);
+		return i + 1;
+	case VOORHEES_FALSE:
+		lua_pushboolean(L, 0);
+		return i + 1;
+	case VOORHEES_TRUE:
+		lua_pushboolean(L, 1);
+		return i + 1;
+	case VOORHEES_NUMBER:
+		if (data >= sn->nnumbers)
+			return 0;
+		lua_pushnumber(L, sn->numbers[data]);
+		return i + 1;
+	case VOORHEES_STRING:
+		if (data > sn->nstrings || n > sn->nstrings - data)
+			return 0;
+		lua_pushlstring(L, sn->strings + data, n);
+		return i + 1;
+	case VOORHEES_ARRAY:
+		if (depth == 0) {
+			sn->overflow = 1;
+			return 0;
+		}
+		if (n > sn->nentries - i)
+			return 0;
+		luaL_checkstack(L, 2, "out of memory");
+		lua_createtable(L, n, 0);
+		i++;
+		for (k = 1; k <= n; k++) {
+			i = load_value(L, sn, i, depth - 1);
+			if (i == 0)
+				return 0;
+			lua_rawseti(L, -2, k);
+		}
+		return i == data ? i : 0;
+	case VOORHEES_OBJECT:
+		if (depth == 0) {
+			sn->overflow = 1;
+			return 0;
+		}
+		if (n > sn->nentries - i)
+			return 0;
+		luaL_checkstack(L, 3, "out of memory");
+		lua_createtable(L, 0, n);
+		i++;
+		for (k = 0; k < n; k++) {
+			if (i >= sn->nentries || (sn->entries[i].tag &
+					VOORHEES_TYPEMASK) != VOORHEES_STRING)
+				return 0;
+			i = load_value(L, sn, i, depth);
+			if (i == 0)
+				return 0;
+			i = load_value(L, sn, i, depth - 1);
+			if (i == 0)
+				return 0;
+			lua_rawset(L, -3);
+		}
+		return i == data ? i : 0;
+	}
+
+	return 0;
+}
+
+/*
+ * This is the load function exported to Lua
+ *
+ * It maps the snapshot file named by the first argument
+ * into memory and builds the document from it
+ */
+static int l_load(lua_State *L)
+{
+	struct parser p;
+	struct snapshot sn;
+	const struct snapshot_header *h;
+	const char *path = luaL_checkstring(L, 1);
+	struct stat st;
+	struct mapping *m;
+	int fd;
+	int ok = 0;
+
+	read_options(L, &p, 2, lua_gettop(L));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 2;
+	}
+
+	if (st.st_size < (off_t)sizeof(struct snapshot_header)) {
+		close(fd);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: not a snapshot", path);
+		return 2;
+	}
+
+	m = lua_newuserdata(L, sizeof(struct mapping));
+	m->p = NULL;
+	m->len = st.st_size;
+	luaL_getmetatable(L, MAPPING_MT);
+	lua_setmetatable(L, -2);
+
+	m->p = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m->p == MAP_FAILED) {
+		m->p = NULL;
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+
+	h = m->p;
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, 4) ||
+			h->version != SNAPSHOT_VERSION ||
+			h->order != SNAPSHOT_ORDER) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: not a snapshot of this version", path);
+		return 2;
+	}
+
+	sn.entries = (const voorhees_entry *)(h + 1);
+	sn.nentries = h->nentries;
+	sn.numbers = (const double *)(sn.entries + h->nentries);
+	sn.nnumbers = h->nnumbers;
+	sn.strings = (const char *)(sn.numbers + h->nnumbers);
+	sn.nstrings = h->nstrings;
+	sn.null_index = p.null_index;
+	sn.overflow = 0;
+
+	/* Check the sections fill the file exactly */
+	if ((double)sizeof(struct snapshot_header) +
+			(double)h->nentries * sizeof(voorhees_entry) +
+			(double)h->nnumbers * sizeof(double) +
+			(double)h->nstrings == (double)st.st_size) {
+		/* Allow the same nesting as parse() */
+		ok = load_value(L, &sn, 0, p.depth - 1) == sn.nentries;
+	}
+
+	munmap(m->p, m->len);
+	m->p = NULL;
+	if (sn.overflow) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "stack overflow");
+		return 2;
+	}
+	if (!ok) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: corrupt snapshot", path);
+		return 2;
+	}
+
+	return 1;
+}
+
+/*
+ * The encoder writes documents into a buffer which is kept in a
+ * userdata between calls, so it only has to grow once. Buffers
+ * which grew bigger than ENCODER_KEEP are freed after use
+ */
+#define ENCODER_MT "voorhees.encoder"
+#define ENCODER_SIZE 4096
+#define ENCODER_KEEP (1024 * 1024)
+
+struct encoder {
+	char *p;
+	size_t len;
+	size_t size;
+	int ascii;
+	unsigned int depth;
+	/* Deepest level of tables written so far */
+	unsigned int deepest;
+	/* Stack indices of the null value, the table of frozen tables
+	 * and the table of their encodings with ascii set */
+	int null_index;
+	int frozen_index;
+	int ascii_index;
+};
+
+static int encoder_gc(lua_State *L)
+{
+	struct encoder *e = lua_touserdata(L, 1);
+
+	free(e->p);
+	e->p = NULL;
+	e->size = 0;
+	return 0;
+}
+
+/*
+ * This function makes room for n more bytes in the buffer
+ * and returns a pointer to the end of it
+ */
+static char *encoder_reserve(lua_State *L, struct encoder *e, size_t n)
+{
+	if (e->size - e->len < n) {
+		size_t size = e->size ? e->size : ENCODER_SIZE;
+		char *p;
+
+		while (size - e->len < n) {
+			size *= 2;
+		}
+		p = realloc(e->p, size);
+		if (p == NULL) {
+			luaL_error(L, "out of memory");
+		}
+		e->p = p;
+		e->size = size;
+	}
+	return e->p + e->len;
+}
+
+static void encoder_write(lua_State *L, struct encoder *e,
+		const char *str, size_t len)
+{
+	memcpy(encoder_reserve(L, e, len), str, len);
+	e->len += len;
+}
+
+/*
+ * Lookup table to get the character following the backslash when
+ * escaping an ASCII character, 'u' for \u00XX escapes or 0 if the
+ * character is written as it is
+ */
+static const char json_escape[128] = {
+	'u','u','u','u','u','u','u','u','b','t','n','u','f','r','u','u',
+	'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+	 0,  0, '"', 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,'\\', 0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0
+};
+
+static void encode_escape(lua_State *L, struct encoder *e, int c)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *out;
+
+	if (c >= 0x10000) {
+		c -= 0x10000;
+		encode_escape(L, e, 0xD800 | (c >> 10));
+		c = 0xDC00 | (c & 1023);
+	}
+
+	out = encoder_reserve(L, e, 6);
+	out[0] = '\\';
+	out[1] = 'u';
+	out[2] = hex[(c >> 12) & 15];
+	out[3] = hex[(c >> 8) & 15];
+	out[4] = hex[(c >> 4) & 15];
+	out[5] = hex[c & 15];
+	e->len += 6;
+}
+
+/*
+ * This function writes a UTF-8 encoded string. Runs of characters
+ * which needn't be escaped are copied in one go. Non-ASCII characters
+ * are only decoded when they must be escaped because ascii is set
+ */
+static void encode_string(lua_State *L, struct encoder *e,
+		const unsigned char *str, size_t len)
+{
+	const unsigned char *end = str + len;
+
+	encoder_reserve(L, e, len + 2);
+	e->p[e->len++] = '"';
+
+	while (str < end) {
+		const unsigned char *run = str;
+		int c;
+
+		while (str < end && (*str < 0x80 ?
+					json_escape[*str] == 0 : !e->ascii)) {
+			str++;
+		}
+		if (str > run) {
+			encoder_write(L, e, (const char *)run, str - run);
+		}
+		if (str == end) {
+			break;
+		}
+
+		c = *str++;
+		if (c < 0x80) {
+			if (json_escape[c] == 'u') {
+				encode_escape(L, e, c);
+			} else {
+				char esc[2];
+
+				esc[0] = '\\';
+				esc[1] = json_escape[c];
+				encoder_write(L, e, esc, 2);
+			}
+			continue;
+		}
+
+		/* Decode the non-ASCII character to escape it */
+		if (utf8_trailing_bytes[c & 127] == 0 ||
+				end - str < utf8_trailing_bytes[c & 127]) {
+			luaL_error(L, "invalid UTF-8 in string");
+		}
+		len = utf8_trailing_bytes[c & 127];
+		c &= utf8_mask[len];
+		for (; len; len--, str++) {
+			if ((*str & 0xC0) != 0x80) {
+				luaL_error(L, "invalid UTF-8 in string");
+			}
+			c = c << 6 | (*str & 63);
+		}
+		if (c > 0x10FFFF) {
+			luaL_error(L, "invalid UTF-8 in string");
+		}
+		encode_escape(L, e, c);
+	}
+
+	encoder_write(L, e, "\"", 1);
+}
+
+/*
+ * This function writes a number the shortest way that reads back as
+ * the same number, or raises an error for infinities and NaN
+ */
+static void encode_number(lua_State *L, struct encoder *e, lua_Number n)
+{
+	char *out;
+	int digits;
+
+	if (n - n != 0) {
+		luaL_error(L, "cannot encode %f", (double)n);
+	}
+
+	out = encoder_reserve(L, e, 32);
+	for (digits = 15; digits < 17; digits++) {
+		sprintf(out, "%.*g", digits, (double)n);
+		if (strtod(out, NULL) == (double)n) {
+			break;
+		}
+	}
+	if (digits == 17) {
+		sprintf(out, "%.17g", (double)n);
+	}
+	e->len += strlen(out);
+}
+
+static void encode_value(lua_State *L, struct encoder *e, int idx,
+		unsigned int level);
+
+/*
+ * This function writes the table at stack index idx as an array
+ * if its keys are exactly 1 to #t, and as an object otherwise
+ */
+static void encode_table(lua_State *L, struct encoder *e, int idx,
+		unsigned int level)
+{
+	size_t n = lua_objlen(L, idx);
+	size_t keys = 0;
+	size_t i;
+	int first = 1;
+
+	if (level >= e->depth) {
+		luaL_error(L, "tables nested too deep");
+	}
+	if (level + 1 > e->deepest) {
+		e->deepest = level + 1;
+	}
+	luaL_checkstack(L, 4, "out of memory");
+
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		lua_Number k;
+
+		lua_pop(L, 1);
+		k = lua_tonumber(L, -1);
+		if (lua_type(L, -1) != LUA_TNUMBER ||
+				k < 1 || k > n || k != (lua_Number)(size_t)k) {
+			lua_pop(L, 1);
+			keys = 0;
+			break;
+		}
+		keys++;
+	}
+
+	if (n > 0 && keys == n) {
+		encoder_write(L, e, "[", 1);
+		for (i = 1; i <= n; i++) {
+			if (i > 1) {
+				encoder_write(L, e, ",", 1);
+			}
+			lua_rawgeti(L, idx, (int)i);
+			encode_value(L, e, lua_gettop(L), level + 1);
+			lua_pop(L, 1);
+		}
+		encoder_write(L, e, "]", 1);
+		return;
+	}
+
+	encoder_write(L, e, "{", 1);
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		size_t len;
+		const char *key;
+
+		if (!first) {
+			encoder_write(L, e, ",", 1);
+		}
+		first = 0;
+
+		switch (lua_type(L, -2)) {
+		case LUA_TSTRING:
+			key = lua_tolstring(L, -2, &len);
+			encode_string(L, e, (const unsigned char *)key, len);
+			break;
+		case LUA_TNUMBER:
+			encoder_write(L, e, "\"", 1);
+			encode_number(L, e, lua_tonumber(L, -2));
+			encoder_write(L, e, "\"", 1);
 			break;
+		default:
+			luaL_error(L, "cannot encode key of type %s",
+					luaL_typename(L, -2));
+		}
+		encoder_write(L, e, ":", 1);
+		encode_value(L, e, lua_gettop(L), level + 1);
+		lua_pop(L, 1);
+	}
+	encoder_write(L, e, "}", 1);
+}
+
+/*
+ * This function writes the value at stack index idx. Frozen tables
+ * which have been encoded before are copied from the cache, and
+ * others are encoded and added to the cache. The cached encodings
+ * start with the number of levels of tables nested in them, so the
+ * depth is checked as if they were encoded again. With another null
+ * value than voorhees.null the cache isn't used
+ */
+static void encode_value(lua_State *L, struct encoder *e, int idx,
+		unsigned int level)
+{
+	size_t len;
+	const char *str;
+	size_t start;
+	unsigned int deepest;
+	unsigned int height;
+	int cache_index;
+	luaL_Buffer b;
+
+	if (lua_rawequal(L, idx, e->null_index)) {
+		encoder_write(L, e, "null", 4);
+		return;
+	}
+
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL:
+		encoder_write(L, e, "null", 4);
+		return;
+
+	case LUA_TBOOLEAN:
+		if (lua_toboolean(L, idx)) {
+			encoder_write(L, e, "true", 4);
+		} else {
+			encoder_write(L, e, "false", 5);
+		}
+		return;
+
+	case LUA_TNUMBER:
+		encode_number(L, e, lua_tonumber(L, idx));
+		return;
+
+	case LUA_TSTRING:
+		str = lua_tolstring(L, idx, &len);
+		encode_string(L, e, (const unsigned char *)str, len);
+		return;
+
+	case LUA_TTABLE:
+		break;
+
+	case LUA_TUSERDATA:
+		if (lua_getmetatable(L, idx)) {
+			luaL_getmetatable(L, VECTOR_MT);
+			if (lua_rawequal(L, -1, -2)) {
+				struct vector *v = lua_touserdata(L, idx);
+
+				lua_pop(L, 2);
+				encoder_write(L, e, "[", 1);
+				for (len = 0; len < v->n; len++) {
+					if (len > 0) {
+						encoder_write(L, e, ",", 1);
+					}
+					encode_number(L, e, v->v[len]);
+				}
+				encoder_write(L, e, "]", 1);
+				return;
+			}
+			lua_pop(L, 2);
+		}
+		/* fall through */
+	default:
+		luaL_error(L, "cannot encode %s", luaL_typename(L, idx));
+	}
+
+	/* Is the table frozen? */
+	if (!lua_rawequal(L, e->null_index, lua_upvalueindex(1))) {
+		encode_table(L, e, idx, level);
+		return;
+	}
+	lua_pushvalue(L, idx);
+	lua_rawget(L, e->frozen_index);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		encode_table(L, e, idx, level);
+		return;
+	}
+
+	cache_index = e->frozen_index;
+	if (e->ascii) {
+		cache_index = e->ascii_index;
+		lua_pop(L, 1);
+		lua_pushvalue(L, idx);
+		lua_rawget(L, cache_index);
+	}
+	if (lua_type(L, -1) == LUA_TSTRING) {
+		str = lua_tolstring(L, -1, &len);
+		memcpy(&height, str, sizeof(height));
+		if (level + height > e->depth) {
+			luaL_error(L, "tables nested too deep");
+		}
+		if (level + height > e->deepest) {
+			e->deepest = level + height;
+		}
+		encoder_write(L, e, str + sizeof(height),
+				len - sizeof(height));
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+
+	deepest = e->deepest;
+	e->deepest = level;
+	start = e->len;
+	encode_table(L, e, idx, level);
+	height = e->deepest - level;
+	if (deepest > e->deepest) {
+		e->deepest = deepest;
+	}
+
+	lua_pushvalue(L, idx);
+	luaL_buffinit(L, &b);
+	luaL_addlstring(&b, (const char *)&height, sizeof(height));
+	luaL_addlstring(&b, e->p + start, e->len - start);
+	luaL_pushresult(&b);
+	lua_rawset(L, cache_index);
+}
+
+/*
+ * This function reads the options of encode() and freeze()
+ * and sets up the encoder kept in upvalue 2
+ */
+static struct encoder *open_encoder(lua_State *L, int idx)
+{
+	struct encoder *e = lua_touserdata(L, lua_upvalueindex(2));
+
+	e->len = 0;
+	e->ascii = 0;
+	e->depth = DEFAULT_DEPTH;
+	e->deepest = 0;
+	e->null_index = lua_upvalueindex(1);
+	e->frozen_index = lua_upvalueindex(3);
+	e->ascii_index = lua_upvalueindex(4);
+
+	if (lua_istable(L, idx)) {
+		lua_getfield(L, idx, "ascii");
+		e->ascii = lua_toboolean(L, -1);
+		lua_getfield(L, idx, "depth");
+		if (!lua_isnil(L, -1)) {
+			lua_Number depth = lua_tonumber(L, -1);
+
+			if (depth < 1) {
+				option_error(L, idx, "depth",
+						"depth must be 1 or greater");
+			}
+			e->depth = (unsigned int)depth;
+		}
+		lua_pop(L, 2);
+
+		lua_getfield(L, idx, "null");
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+		} else {
+			e->null_index = lua_gettop(L);
+		}
+	} else if (!lua_isnoneornil(L, idx)) {
+		luaL_checktype(L, idx, LUA_TTABLE);
+	}
+
+	return e;
+}
+
+/*
+ * This function pushes the encoded document and
+ * frees the buffer if it has grown too big
+ */
+static void push_encoded(lua_State *L, struct encoder *e)
+{
+	lua_pushlstring(L, e->p, e->len);
+	if (e->size > ENCODER_KEEP) {
+		free(e->p);
+		e->p = NULL;
+		e->size = 0;
+	}
+	e->len = 0;
+}
+
+/*
+ * This is the encode function exported to Lua
+ *
+ * It returns the value given as the first argument as a JSON text
+ */
+static int l_encode(lua_State *L)
+{
+	struct encoder *e;
+
+	luaL_checkany(L, 1);
+	e = open_encoder(L, 2);
+	encode_value(L, e, 1, 0);
+	push_encoded(L, e);
+	return 1;
+}
+
+/*
+ * This is the freeze function exported to Lua
+ *
+ * It marks the table given as the first argument as frozen, so
+ * encode() caches its encoding. If the second argument is true it is
+ * encoded right away, and its length is returned after the table
+ */
+static int l_freeze(lua_State *L)
+{
+	struct encoder *e;
+	size_t len;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	/* Forget the old encodings */
+	lua_pushvalue(L, 1);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, lua_upvalueindex(3));
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, lua_upvalueindex(4));
+
+	if (!lua_toboolean(L, 2)) {
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	e = open_encoder(L, 3);
+	encode_value(L, e, 1, 0);
+	len = e->len;
+	e->len = 0;
+	lua_settop(L, 1);
+	lua_pushnumber(L, (lua_Number)len);
+	return 2;
+}
+
+/*
+ * Schemas compiled by compile_schema() describe the arrays, objects
+ * and types of values expected in a document
+ */
+enum schema_type {
+	SCHEMA_ANY,
+	SCHEMA_STRING,
+	SCHEMA_NUMBER,
+	SCHEMA_INTEGER,
+	SCHEMA_BOOLEAN,
+	SCHEMA_BASE64,
+	SCHEMA_ARRAY,
+	SCHEMA_OBJECT
+};
+
+static const char *const schema_names[] = {
+	"any", "string", "number", "integer", "boolean", "base64", NULL
+};
+
+struct schema_field {
+	const char *key;
+	size_t len;
+	/* Index of the key in the anchor table */
+	int ref;
+	const struct schema *type;
+};
+
+/*
+ * The fields of an object are found by hashing the raw bytes of the
+ * key with the seed into a table of slots with linear probing. The
+ * seed is chosen so no two fields hash to the same slot if possible,
+ * so looking up a key usually takes one hash, one probe and one
+ * comparison
+ */
+struct schema {
+	enum schema_type type;
+	/* Schema of the elements of an array */
+	const struct schema *items;
+	unsigned int nfields;
+	unsigned int mask;
+	unsigned int seed;
+	struct schema_field *fields;
+	struct schema_field **slots;
+};
+
+/*
+ * The schemas of the simple types are shared
+ */
+static const struct schema schema_simple[] = {
+	{ SCHEMA_ANY, NULL, 0, 0, 0, NULL, NULL },
+	{ SCHEMA_STRING, NULL, 0, 0, 0, NULL, NULL },
+	{ SCHEMA_NUMBER, NULL, 0, 0, 0, NULL, NULL },
+	{ SCHEMA_INTEGER, NULL, 0, 0, 0, NULL, NULL },
+	{ SCHEMA_BOOLEAN, NULL, 0, 0, 0, NULL, NULL },
+	{ SCHEMA_BASE64, NULL, 0, 0, 0, NULL, NULL }
+};
+
+#define MAX_SCHEMA_DEPTH 64
+
+/*
+ * The schema decoder recurses on the C stack for every level of
+ * nesting, so documents nested deeper than this, or the depth
+ * option, are left to the generic parser
+ */
+#define MAX_DECODE_DEPTH 128
+
+/*
+ * FNV-1a hash of key bytes, computed while the key is scanned
+ */
+#define key_hash_init(seed) (2166136261U ^ (seed))
+#define key_hash_step(h, c) (((h) ^ (c)) * 16777619U)
+#define key_hash_slot(h, mask) (((h) ^ ((h) >> 16)) & (mask))
 
-		case T1:
-			lua_pushboolean(L, 1);
-			r++;
-			break;
+static unsigned int key_hash(unsigned int seed, const char *key, size_t len)
+{
+	unsigned int h = key_hash_init(seed);
 
-		case F1:
-			lua_pushboolean(L, 0);
-			r++;
-			break;
+	for (; len; len--, key++) {
+		h = key_hash_step(h, (unsigned char)*key);
+	}
+	return h & 0xFFFFFFFFU;
+}
 
-		case MI:
-		case ZE:
-		case IT:
-		case FP:
-		case FR:
-		case E1:
-		case E2:
-		case E3:
-			*s.p++ = (char)next_char;
-			s.written++;
-			if (s.written == STRBUF_SIZE) {
-				flush_buffer();
-			}
-			break;
+/*
+ * This function finds a seed so the fields all hash to different
+ * slots, trying a table of twice and four times the number of fields.
+ * If there is none the fields are inserted with linear probing
+ */
+static void schema_hash_fields(struct schema *s, unsigned int size)
+{
+	unsigned int seed;
+	unsigned int slot;
+	unsigned int i;
 
-		case XS: /* begin string */
-			/* this is a special action, so we
-			 * don't push the beginning " */
-			state = ST;
-			break;
+	for (;; size *= 2) {
+		for (seed = 0; seed < 64; seed++) {
+			memset(s->slots, 0, size * sizeof(struct schema_field *));
+			for (i = 0; i < s->nfields; i++) {
+				struct schema_field *f = &s->fields[i];
 
-		case ST:
-			putchar(&s, next_char);
-			if (s.written >= (STRBUF_SIZE - 4)) {
-				flush_buffer();
+				slot = key_hash_slot(key_hash(seed,
+						f->key, f->len), size - 1);
+				if (s->slots[slot] != NULL) {
+					break;
+				}
+				s->slots[slot] = f;
+			}
+			if (i == s->nfields || (seed == 63 &&
+						size >= 4 * s->nfields)) {
+				break;
 			}
+		}
+		if (seed < 64) {
 			break;
+		}
+	}
 
-		case YE: /* put an escaped character */
-			switch (next_char) {
-			case 'b':
-				putchar(&s, '\b');
+	s->mask = size - 1;
+	s->seed = seed;
+	if (i == s->nfields) {
+		return;
+	}
+
+	memset(s->slots, 0, size * sizeof(struct schema_field *));
+	for (i = 0; i < s->nfields; i++) {
+		struct schema_field *f = &s->fields[i];
+
+		slot = key_hash_slot(key_hash(seed, f->key, f->len), s->mask);
+		while (s->slots[slot] != NULL) {
+			slot = (slot + 1) & s->mask;
+		}
+		s->slots[slot] = f;
+	}
+}
+
+/*
+ * This function compiles the schema at stack index idx. The compiled
+ * schemas and their keys are kept alive in the anchor table, and the
+ * JSON pointers of base64 strings are added to the table at index
+ * paths for when the document is parsed by the generic parser.
+ * The pointer of the value is on top of the stack
+ */
+static const struct schema *compile_schema(lua_State *L, int idx,
+		int anchor, int paths, unsigned int level)
+{
+	struct schema *s;
+	unsigned int n = 0;
+	unsigned int size;
+	unsigned int i;
+	int pointer = lua_gettop(L);
+
+	if (level > MAX_SCHEMA_DEPTH) {
+		luaL_error(L, "schema nested too deep");
+	}
+	luaL_checkstack(L, 8, "out of memory");
+
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		const char *name = lua_tostring(L, idx);
+
+		for (i = 0; schema_names[i] != NULL; i++) {
+			if (strcmp(name, schema_names[i]) == 0) {
 				break;
-			case 'f':
-				putchar(&s, '\f');
+			}
+		}
+		if (schema_names[i] == NULL) {
+			luaL_error(L, "unknown type '%s' in schema", name);
+		}
+		if (i == SCHEMA_BASE64) {
+			lua_pushvalue(L, pointer);
+			lua_rawseti(L, paths, (int)lua_objlen(L, paths) + 1);
+		}
+		return &schema_simple[i];
+	}
+
+	if (!lua_istable(L, idx)) {
+		luaL_error(L, "expected type or table in schema, got %s",
+				luaL_typename(L, idx));
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		lua_pop(L, 1);
+		if (lua_type(L, -1) != LUA_TSTRING &&
+				!(lua_type(L, -1) == LUA_TNUMBER &&
+				  lua_tonumber(L, -1) == 1)) {
+			luaL_error(L, "unexpected key in schema");
+		}
+		n++;
+	}
+
+	/* Arrays are described by a list of one schema */
+	lua_rawgeti(L, idx, 1);
+	if (!lua_isnil(L, -1)) {
+		if (n != 1) {
+			luaL_error(L, "array schemas must have one element");
+		}
+		s = lua_newuserdata(L, sizeof(struct schema));
+		memset(s, 0, sizeof(struct schema));
+		s->type = SCHEMA_ARRAY;
+		lua_rawseti(L, anchor, (int)lua_objlen(L, anchor) + 1);
+
+		lua_pushvalue(L, pointer);
+		lua_pushliteral(L, "/*");
+		lua_concat(L, 2);
+		s->items = compile_schema(L, pointer + 1, anchor,
+				paths, level + 1);
+		lua_settop(L, pointer);
+		return s;
+	}
+	lua_pop(L, 1);
+
+	for (size = 1; size < 2 * n; size *= 2);
+	s = lua_newuserdata(L, sizeof(struct schema) +
+			n * sizeof(struct schema_field) +
+			4 * size * sizeof(struct schema_field *));
+	memset(s, 0, sizeof(struct schema));
+	s->type = SCHEMA_OBJECT;
+	s->nfields = n;
+	s->fields = (struct schema_field *)(s + 1);
+	s->slots = (struct schema_field **)(s->fields + n);
+	lua_rawseti(L, anchor, (int)lua_objlen(L, anchor) + 1);
+
+	i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		struct schema_field *f = &s->fields[i++];
+		luaL_Buffer b;
+		const char *key;
+		size_t len;
+
+		lua_pushvalue(L, -2);
+		f->ref = (int)lua_objlen(L, anchor) + 1;
+		lua_rawseti(L, anchor, f->ref);
+		f->key = lua_tolstring(L, -2, &f->len);
+
+		/* Append the key to the pointer */
+		luaL_buffinit(L, &b);
+		lua_pushvalue(L, pointer);
+		luaL_addvalue(&b);
+		luaL_addchar(&b, '/');
+		for (key = f->key, len = f->len; len; key++, len--) {
+			switch (*key) {
+			case '~':
+				luaL_addstring(&b, "~0");
 				break;
-			case 'n':
-				putchar(&s, '\n');
+			case '/':
+				luaL_addstring(&b, "~1");
 				break;
-			case 'r':
-				putchar(&s, '\r');
+			default:
+				luaL_addchar(&b, *key);
+			}
+		}
+		luaL_pushresult(&b);
+
+		f->type = compile_schema(L, lua_gettop(L) - 1, anchor,
+				paths, level + 1);
+		lua_pop(L, 2);
+	}
+
+	schema_hash_fields(s, size);
+	return s;
+}
+
+/*
+ * State of the decoder of a compiled schema. It reads the document
+ * directly from memory by recursive descent. Whenever the document
+ * doesn't match the schema, or can't be decoded this way, the
+ * functions return -1 and the document is parsed by the generic
+ * parser instead, which also reports any syntax errors
+ */
+struct schema_decoder {
+	lua_State *L;
+	const unsigned char *p;
+	const unsigned char *end;
+	int anchor;
+	int null_index;
+	unsigned int depth;
+	/* Number of elements and keys read, and the
+	 * parser holding the limits on them */
+	size_t elements;
+	size_t keys;
+	const struct parser *limits;
+};
+
+#define skip_space(d) \
+	while ((d)->p < (d)->end && (*(d)->p == ' ' || *(d)->p == '\t' || \
+			*(d)->p == '\n' || *(d)->p == '\r')) \
+		(d)->p++
+
+static int schema_literal(struct schema_decoder *d, const char *word,
+		size_t len)
+{
+	if ((size_t)(d->end - d->p) < len || memcmp(d->p, word, len))
+		return -1;
+	d->p += len;
+	return 0;
+}
+
+/*
+ * This function scans the string starting at the quote d->p points
+ * at. The characters are checked, and *escaped is set if it has any
+ * escapes. Returns a pointer to the closing quote or NULL
+ */
+static const unsigned char *schema_scan_string(struct schema_decoder *d,
+		int *escaped)
+{
+	const unsigned char *p = d->p + 1;
+	const unsigned char *end = d->end;
+
+	*escaped = 0;
+	while (p < end) {
+		unsigned int c = *p;
+		unsigned int n;
+
+		if (c == '"') {
+			return p;
+		}
+		if (c == '\\') {
+			if (end - p < 2)
+				return NULL;
+			*escaped = 1;
+			switch (p[1]) {
+			case '"': case '\\': case '/': case 'b':
+			case 'f': case 'n': case 'r': case 't':
+				p += 2;
 				break;
-			case 't':
-				putchar(&s, '\t');
+			case 'u':
+				if (end - p < 6 || hex4(p + 2) < 0)
+					return NULL;
+				p += 6;
 				break;
 			default:
-				putchar(&s, next_char);
-			}
-			if (s.written >= (STRBUF_SIZE - 4)) {
-				flush_buffer();
+				return NULL;
 			}
-			state = ST;
+			continue;
+		}
+		if (c < 0x20)
+			return NULL;
+		p++;
+		if (c < 0x80)
+			continue;
+
+		/* Check the trailing bytes like utf8_getchar(). The generic
+		 * parser writes overlong sequences in their shortest form,
+		 * so they're left to it */
+		n = utf8_trailing_bytes[c & 127];
+		if (n == 0 || (unsigned int)(end - p) < n)
+			return NULL;
+		if (c == 0xC0 || c == 0xC1 || (c == 0xE0 && *p < 0xA0) ||
+				(c == 0xF0 && *p < 0x90))
+			return NULL;
+		for (; n; n--, p++) {
+			if ((*p & 0xC0) != 0x80)
+				return NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * This function pushes the string with escapes between p and end
+ */
+static int schema_unescape(struct schema_decoder *d,
+		const unsigned char *p, const unsigned char *end)
+{
+	luaL_Buffer b;
+
+	luaL_buffinit(d->L, &b);
+	while (p < end) {
+		const unsigned char *run = p;
+		int c;
+
+		while (p < end && *p != '\\')
+			p++;
+		luaL_addlstring(&b, (const char *)run, p - run);
+		if (p == end)
 			break;
 
-		case U3:
-		case U4:
-			unicode <<= 4;
-		case U2:
-			if (next_char <= '9') {
-				unicode |= (next_char - '0');
-			} else if (next_char <= 'F') {
-				unicode |= next_char - 55;
-			} else {
-				unicode |= next_char - 87;
+		switch (p[1]) {
+		case 'b': c = '\b'; break;
+		case 'f': c = '\f'; break;
+		case 'n': c = '\n'; break;
+		case 'r': c = '\r'; break;
+		case 't': c = '\t'; break;
+		case 'u':
+			c = hex4(p + 2);
+			if (c >= 0xDC00 && c < 0xE000)
+				return -1;
+			if (c >= 0xD800 && c < 0xDC00) {
+				int low;
+
+				if (end - p < 12 || p[6] != '\\' ||
+						p[7] != 'u')
+					return -1;
+				low = hex4(p + 8);
+				if (low < 0xDC00 || low >= 0xE000)
+					return -1;
+				c = 0x10000 | (c & 1023) << 10 | (low & 1023);
+				p += 6;
 			}
+			p += 4;
 			break;
+		default:
+			c = p[1];
+		}
+		p += 2;
 
-		case YU: /* write the escaped unicode character */
-			/* Read the last hex char */
-			unicode <<= 4;
-			if (next_char <= '9') {
-				unicode |= next_char - '0';
-			} else if (next_char <= 'F') {
-				unicode |= next_char - 55;
-			} else {
-				unicode |= next_char - 87;
+		if (c < 0x80) {
+			luaL_addchar(&b, (char)c);
+		} else {
+			struct strbuf s;
+
+			s.written = 0;
+			s.p = s.base;
+			utf8_putchar(&s, c);
+			luaL_addlstring(&b, s.base, s.written);
+		}
+	}
+	luaL_pushresult(&b);
+	return 0;
+}
+
+static int schema_string(struct schema_decoder *d, int base64)
+{
+	const unsigned char *end;
+	int escaped;
+
+	if (d->p == d->end || *d->p != '"')
+		return -1;
+	end = schema_scan_string(d, &escaped);
+	if (end == NULL)
+		return -1;
+
+	if (base64) {
+		struct strbuf s;
+		luaL_Buffer b;
+		const unsigned char *p = d->p + 1;
+		unsigned long bits = 0;
+		int n = 0;
+
+		/* The generic parser handles escapes */
+		if (escaped)
+			return -1;
+
+		luaL_buffinit(d->L, &b);
+		s.written = 0;
+		s.p = s.base;
+		while (p < end) {
+			if (n == 0) {
+				struct input in;
+
+				in.p = p;
+				in.len = end - p;
+				in.read = 0;
+				base64_fast(&in, &s);
+				p = in.p;
 			}
-			/* If its a high surrogate.. */
-			if (unicode >= 0xD800 && unicode < 0xDC00) {
-				high_sur = unicode;
-				state = L1; /* ..the low must follow */
-			} else {
-				/* Should this be a low surrogate? */
-				if (high_sur) { 
-					if (unicode < 0xDC00 ||
-							unicode >= 0xE000)
-						goto syntax_error;
+			if (p < end && base64_putchar(&s, &bits, &n, *p++))
+				return -1;
+			if (s.written >= STRBUF_SIZE - 4 || p == end) {
+				luaL_addlstring(&b, s.base, s.written);
+				s.written = 0;
+				s.p = s.base;
+			}
+		}
+		if (n != 0 && n != 8)
+			return -1;
+		luaL_pushresult(&b);
+		if (lua_objlen(d->L, -1) > d->limits->max_string)
+			return -1;
+	} else if (escaped) {
+		if (schema_unescape(d, d->p + 1, end))
+			return -1;
+		if (lua_objlen(d->L, -1) > d->limits->max_string)
+			return -1;
+	} else {
+		if ((size_t)(end - d->p - 1) > d->limits->max_string)
+			return -1;
+		lua_pushlstring(d->L, (const char *)d->p + 1, end - d->p - 1);
+	}
+
+	d->p = end + 1;
+	return 0;
+}
+
+/*
+ * This function reads a number. Integers of up to 15 digits are
+ * converted directly, and anything else by strtod() from a copy.
+ * If integer is set numbers with fractions or exponents don't match
+ */
+static int schema_number(struct schema_decoder *d, int integer,
+		int push)
+{
+	const unsigned char *p = d->p;
+	const unsigned char *end = d->end;
+	const unsigned char *start = p;
+	double n = 0;
+	int simple = 1;
+
+	if (p < end && *p == '-')
+		p++;
+	if (p == end || *p < '0' || *p > '9')
+		return -1;
+	if (*p == '0') {
+		p++;
+	} else {
+		while (p < end && *p >= '0' && *p <= '9') {
+			n = 10 * n + (*p - '0');
+			p++;
+		}
+	}
+	if (p < end && *p == '.') {
+		simple = 0;
+		p++;
+		if (p == end || *p < '0' || *p > '9')
+			return -1;
+		while (p < end && *p >= '0' && *p <= '9')
+			p++;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		simple = 0;
+		p++;
+		if (p < end && (*p == '+' || *p == '-'))
+			p++;
+		if (p == end || *p < '0' || *p > '9')
+			return -1;
+		while (p < end && *p >= '0' && *p <= '9')
+			p++;
+	}
+	if (integer && !simple)
+		return -1;
+
+	if (push) {
+		if (!simple || p - start > 15) {
+			char num[64];
+
+			if (p - start >= (int)sizeof(num))
+				return -1;
+			memcpy(num, start, p - start);
+			num[p - start] = '\0';
+			n = strtod(num, NULL);
+		} else if (*start == '-') {
+			n = -n;
+		}
+		lua_pushnumber(d->L, n);
+	}
+
+	d->p = p;
+	return 0;
+}
+
+static int schema_value(struct schema_decoder *d, const struct schema *s,
+		unsigned int level);
+static int schema_skip(struct schema_decoder *d, unsigned int level);
+
+/*
+ * This function reads a value of any type into a table like the
+ * generic parser, or skips it if push isn't set
+ */
+static int schema_any(struct schema_decoder *d, unsigned int level,
+		int push)
+{
+	lua_State *L = d->L;
+	int escaped;
+	int n = 0;
+
+	if (d->p == d->end)
+		return -1;
+
+	switch (*d->p) {
+	case '"':
+		if (push)
+			return schema_string(d, 0);
+		d->p = schema_scan_string(d, &escaped);
+		if (d->p == NULL)
+			return -1;
+		d->p++;
+		return 0;
+	case 't':
+		if (push)
+			lua_pushboolean(L, 1);
+		return schema_literal(d, "true", 4);
+	case 'f':
+		if (push)
+			lua_pushboolean(L, 0);
+		return schema_literal(d, "false", 5);
+	case 'n':
+		if (push)
+			lua_pushvalue(L, d->null_index);
+		return schema_literal(d, "null", 4);
+	case '[':
+	case '{':
+		break;
+	default:
+		return schema_number(d, 0, push);
+	}
+
+	if (level + 1 >= d->depth)
+		return -1;
+	luaL_checkstack(L, 4, "out of memory");
+	if (push)
+		lua_newtable(L);
+
+	if (*d->p++ == '[') {
+		skip_space(d);
+		if (d->p < d->end && *d->p == ']') {
+			d->p++;
+			return 0;
+		}
+		for (;;) {
+			skip_space(d);
+			if (schema_any(d, level + 1, push))
+				return -1;
+			if (++d->elements > d->limits->max_elements)
+				return -1;
+			if (push)
+				lua_rawseti(L, -2, ++n);
+			skip_space(d);
+			if (d->p == d->end)
+				return -1;
+			if (*d->p++ == ']')
+				return 0;
+			if (d->p[-1] != ',')
+				return -1;
+		}
+	}
+
+	skip_space(d);
+	if (d->p < d->end && *d->p == '}') {
+		d->p++;
+		return 0;
+	}
+	for (;;) {
+		skip_space(d);
+		if (d->p == d->end || *d->p != '"')
+			return -1;
+		if (push) {
+			if (schema_string(d, 0))
+				return -1;
+		} else {
+			d->p = schema_scan_string(d, &escaped);
+			if (d->p == NULL)
+				return -1;
+			d->p++;
+		}
+		if (++d->keys > d->limits->max_keys)
+			return -1;
+		skip_space(d);
+		if (d->p == d->end || *d->p++ != ':')
+			return -1;
+		skip_space(d);
+		if (schema_any(d, level + 1, push))
+			return -1;
+		if (push)
+			lua_rawset(L, -3);
+		skip_space(d);
+		if (d->p == d->end)
+			return -1;
+		if (*d->p++ == '}')
+			return 0;
+		if (d->p[-1] != ',')
+			return -1;
+	}
+}
+
+static int schema_skip(struct schema_decoder *d, unsigned int level)
+{
+	return schema_any(d, level, 0);
+}
+
+/*
+ * This function reads an object of the schema. The table is created
+ * with room for all the fields, the keys are looked up by their raw
+ * bytes and the values of unknown keys are skipped
+ */
+static int schema_object(struct schema_decoder *d, const struct schema *s,
+		unsigned int level)
+{
+	lua_State *L = d->L;
 
-					unicode &= 1023;
-					unicode |= (high_sur & 1023) << 10;
-					unicode |= 0x10000;
-					high_sur = 0;
-				}
-				putchar(&s, unicode);
-				if (s.written >= (STRBUF_SIZE - 4)) {
-					flush_buffer();
-				}
-				state = ST;
-			}
-			unicode = 0;
-			break;
+	if (level + 1 >= d->depth)
+		return -1;
+	luaL_checkstack(L, 4, "out of memory");
+	lua_createtable(L, 0, (int)s->nfields);
 
-		case XA: /* begin array */
-			top++;
-			if (top == depth) {
-				goto stack_overflow;
-			}
-			stack[top] = MODE_ARRAY;
-			lua_newtable(L);
-			r++;
-			state = A0;
-			break;
+	d->p++;
+	skip_space(d);
+	if (d->p < d->end && *d->p == '}') {
+		d->p++;
+		return 0;
+	}
 
-		case XO: /* begin object */
-			top++;
-			if (top == depth) {
-				goto stack_overflow;
-			}
-			stack[top] = MODE_KEY;
-			lua_newtable(L);
-			r++;
-			state = OB;
-			break;
+	for (;;) {
+		const unsigned char *key;
+		const unsigned char *p;
+		const struct schema_field *f;
+		unsigned int h = key_hash_init(s->seed);
+		unsigned int slot;
+		unsigned int high = 0;
+		int escaped;
 
-		case ZN: /* end number */
-			if (s.written) {
-				flush_buffer();
-			}
-			lua_concat(L, s.parts);
-			r += 1 - s.parts;
-			s.parts = 0;
-			lua_pushnumber(L, lua_tonumber(L, -1));
-			lua_remove(L, -2);
-			state = OK;
-			goto again;
+		skip_space(d);
+		if (d->p == d->end || *d->p != '"')
+			return -1;
 
-		case ZS: /* end string */
-			if (s.written) {
-				flush_buffer();
-			}
-			lua_concat(L, s.parts);
-			r += 1 - s.parts;
-			s.parts = 0;
-			switch (stack[top]) {
-			case MODE_KEY:
-				state = CO;
-				break;
-			case MODE_ARRAY:
-			case MODE_OBJECT:
-				state = OK;
+		/* Hash the key while looking for its end.
+		 * Keys with escapes are left to the generic parser */
+		key = p = d->p + 1;
+		while (p < d->end && *p != '"') {
+			if (*p == '\\' || *p < 0x20)
+				return -1;
+			high |= *p;
+			h = key_hash_step(h, *p);
+			p++;
+		}
+		if (p == d->end)
+			return -1;
+		if ((high & 0x80) && schema_scan_string(d, &escaped) == NULL)
+			return -1;
+		if (++d->keys > d->limits->max_keys)
+			return -1;
+		d->p = p + 1;
+
+		skip_space(d);
+		if (d->p == d->end || *d->p++ != ':')
+			return -1;
+		skip_space(d);
+
+		h &= 0xFFFFFFFFU;
+		slot = key_hash_slot(h, s->mask);
+		while ((f = s->slots[slot]) != NULL) {
+			if (f->len == (size_t)(p - key) &&
+					memcmp(f->key, key, f->len) == 0)
 				break;
-			default:
-				goto syntax_error;
-			}
-			break;
+			slot = (slot + 1) & s->mask;
+		}
 
-		case Z0: /* end empty array */
-			if (stack[top] != MODE_ARRAY) {
-				goto syntax_error;
-			}
-			top--;
-			state = OK;
-			break;
+		if (f == NULL) {
+			if (schema_skip(d, level + 1))
+				return -1;
+		} else {
+			lua_rawgeti(L, d->anchor, f->ref);
+			if (schema_value(d, f->type, level + 1))
+				return -1;
+			lua_rawset(L, -3);
+		}
 
-		case ZA: /* end array */
-			if (stack[top] != MODE_ARRAY) {
-				goto syntax_error;
-			}
-			top--;
-			lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
-			r--;
-			state = OK;
-			break;
+		skip_space(d);
+		if (d->p == d->end)
+			return -1;
+		if (*d->p++ == '}')
+			return 0;
+		if (d->p[-1] != ',')
+			return -1;
+	}
+}
 
-		case ZQ: /* end empty object */
-			if (stack[top] != MODE_KEY) {
-				goto syntax_error;
-			}
-			top--;
-			state = OK;
-			break;
+static int schema_array(struct schema_decoder *d, const struct schema *s,
+		unsigned int level)
+{
+	lua_State *L = d->L;
+	int n = 0;
 
-		case ZO: /* end object */
-			if (stack[top] != MODE_OBJECT) {
-				goto syntax_error;
-			}
-			top--;
-			lua_rawset(L, -3);
-			r -= 2;
-			state = OK;
-			break;
+	if (level + 1 >= d->depth)
+		return -1;
+	luaL_checkstack(L, 4, "out of memory");
+	lua_newtable(L);
 
-		case YN: /* next key/value pair or array entry */
-			switch (stack[top]) {
-			case MODE_OBJECT:
-				/* A comma causes a flip from
-				 * object mode to key mode. */
-				if (stack[top] != MODE_OBJECT) {
-					goto syntax_error;
-				}
-				stack[top] = MODE_KEY;
-				lua_rawset(L, -3);
-				r -= 2;
-				state = KE;
-				break;
-			case MODE_ARRAY:
-				lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
-				r--;
-				state = VA;
-				break;
-			default:
-				goto syntax_error;
-			}
-			break;
+	d->p++;
+	skip_space(d);
+	if (d->p < d->end && *d->p == ']') {
+		d->p++;
+		return 0;
+	}
 
-		case YV: /* key read, now read the value */
-			/* A colon causes a flip from key mode
-			 * to object mode. */
-			if (stack[top] != MODE_KEY) {
-				goto syntax_error;
-			}
-			stack[top] = MODE_OBJECT;
-			state = VA;
-			break;
+	for (;;) {
+		skip_space(d);
+		if (schema_value(d, s->items, level + 1))
+			return -1;
+		if (++d->elements > d->limits->max_elements)
+			return -1;
+		lua_rawseti(L, -2, ++n);
+		skip_space(d);
+		if (d->p == d->end)
+			return -1;
+		if (*d->p++ == ']')
+			return 0;
+		if (d->p[-1] != ',')
+			return -1;
+	}
+}
 
-		case __: /* bad state */
-			goto syntax_error;
+/*
+ * This function reads a value of the schema. Any value may be null
+ */
+static int schema_value(struct schema_decoder *d, const struct schema *s,
+		unsigned int level)
+{
+	lua_State *L = d->L;
+
+	if (d->p == d->end)
+		return -1;
+
+	if (*d->p == 'n' && s->type != SCHEMA_ANY) {
+		lua_pushvalue(L, d->null_index);
+		return schema_literal(d, "null", 4);
+	}
+
+	switch (s->type) {
+	case SCHEMA_ANY:
+		return schema_any(d, level, 1);
+	case SCHEMA_STRING:
+		return schema_string(d, 0);
+	case SCHEMA_BASE64:
+		return schema_string(d, 1);
+	case SCHEMA_NUMBER:
+		return schema_number(d, 0, 1);
+	case SCHEMA_INTEGER:
+		return schema_number(d, 1, 1);
+	case SCHEMA_BOOLEAN:
+		if (*d->p == 't') {
+			lua_pushboolean(L, 1);
+			return schema_literal(d, "true", 4);
 		}
+		lua_pushboolean(L, 0);
+		return schema_literal(d, "false", 5);
+	case SCHEMA_ARRAY:
+		if (*d->p != '[')
+			return -1;
+		return schema_array(d, s, level);
+	case SCHEMA_OBJECT:
+		if (*d->p != '{')
+			return -1;
+		return schema_object(d, s, level);
 	}
+	return -1;
+}
 
-	/*
-	 * Part 3: Check everything went alright,
-	 * free the stack and return
-	 */
+/*
+ * This is the function returned by compile_schema()
+ *
+ * Upvalue 3 holds the options for the generic parser and
+ * upvalue 4 the compiled schema, or NULL if the options
+ * aren't supported by the schema decoder
+ */
+static int l_schema_decode(lua_State *L)
+{
+	struct parser p;
+	struct schema_decoder d;
+	const struct schema *root;
+	int ret;
+	int base;
 
-	/* Did we encounter an encoding error? */
-	if (next_char < 0) {
-		lua_pop(L, r);
-		free(stack);
-		lua_pushnil(L);
-		lua_pushfstring(L, "encoding error after %d bytes",
-				(int)in.read);
-		return 2;
+	ret = open_input(L, &p);
+	if (ret) {
+		return ret;
 	}
 
-	/* Check if the JSON text finish properly */
-	if (state != OK || stack[top] != MODE_DONE) {
-		goto syntax_error;
+	lua_pushvalue(L, lua_upvalueindex(3));
+	read_options(L, &p, lua_gettop(L), lua_gettop(L));
+	base = lua_gettop(L);
+
+	root = lua_touserdata(L, lua_upvalueindex(4));
+	if (root != NULL && p.in.string_index == 0 &&
+			p.getchar == utf8_getchar &&
+			p.in.len <= p.in.limit) {
+		d.L = L;
+		d.p = p.in.p;
+		d.end = p.in.p + p.in.len;
+		d.anchor = lua_upvalueindex(2);
+		d.null_index = p.null_index;
+		d.depth = p.depth < MAX_DECODE_DEPTH ?
+			p.depth : MAX_DECODE_DEPTH;
+		d.elements = 0;
+		d.keys = 0;
+		d.limits = &p;
+
+		skip_space(&d);
+		if (d.p < d.end && (*d.p == '[' || *d.p == '{') &&
+				schema_value(&d, root, 0) == 0) {
+			skip_space(&d);
+			if (d.p == d.end) {
+				return 1;
+			}
+		}
+		lua_settop(L, base);
 	}
 
-	free(stack);
+	return run_parse(L, &p);
+}
 
-	/* If this fails we did something wrong */
-	if (r != 1) {
-		lua_pop(L, r);
-		lua_pushnil(L);
-		lua_pushfstring(L, "r = %d", r);
-		return 2;
+/*
+ * This is the compile_schema function exported to Lua
+ *
+ * It compiles the schema given as the first argument and returns
+ * a function decoding documents of that schema. Any other documents
+ * are parsed by the generic parser with the options given as the
+ * second argument
+ */
+static int l_compile_schema(lua_State *L)
+{
+	struct parser p;
+	const struct schema *root;
+	int supported;
+
+	lua_settop(L, 2);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (lua_isnil(L, 2)) {
+		lua_newtable(L);
+		lua_replace(L, 2);
 	}
+	luaL_checktype(L, 2, LUA_TTABLE);
 
-	return 1;
+	/* Check the options now, and if the schema decoder supports them */
+	read_options(L, &p, 2, 2);
+	supported = p.putchar == utf8_putchar && p.path == NULL &&
+		!p.packed && p.sink_index == 0 && p.nbase64 == 0 &&
+		p.max_memory == (size_t)-1 && p.in.gc_step < 0 &&
+		p.in.progress_index == 0
+#if LUA_VERSION_NUM >= 504
+		&& !p.generational
+#endif
+		;
+	lua_settop(L, 2);
 
-	/*
-	 * We jump to here in case of errors encountered
-	 * while parsing
-	 */
-syntax_error:
-	lua_pop(L, r);
-	free(stack);
-	lua_pushnil(L);
-	lua_pushfstring(L, "syntax error after %d bytes", (int)in.read);
-	return 2;
+	lua_pushvalue(L, lua_upvalueindex(1));
 
-stack_overflow:
-	lua_pop(L, r);
-	free(stack);
+	/* The anchor table holds the compiled schemas and keys */
+	lua_newtable(L);
+
+	/* The generic parser gets a copy of the options with the
+	 * base64 strings of the schema added */
+	lua_newtable(L);
 	lua_pushnil(L);
-	lua_pushliteral(L, "stack overflow");
-	return 2;
+	while (lua_next(L, 2)) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, 5);
+	}
+
+	lua_newtable(L);
+	lua_pushliteral(L, "");
+	root = compile_schema(L, 1, 4, 6, 0);
+	lua_pop(L, 1);
+	if (root->type != SCHEMA_ARRAY && root->type != SCHEMA_OBJECT) {
+		return luaL_argerror(L, 1, "expected array or object schema");
+	}
+
+	if (lua_objlen(L, 6) > 0) {
+		lua_getfield(L, 2, "base64");
+		if (lua_istable(L, -1)) {
+			size_t i;
+
+			for (i = 1; i <= lua_objlen(L, -1); i++) {
+				lua_rawgeti(L, -1, (int)i);
+				lua_rawseti(L, 6, (int)lua_objlen(L, 6) + 1);
+			}
+		} else if (!lua_isnil(L, -1)) {
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, 6, (int)lua_objlen(L, 6) + 1);
+		}
+		lua_pop(L, 1);
+		lua_setfield(L, 5, "base64");
+	} else {
+		lua_pop(L, 1);
+	}
+
+	lua_pushlightuserdata(L, supported ? (void *)root : NULL);
+	lua_pushcclosure(L, l_schema_decode, 4);
+	return 1;
 }
 
 /*
@@ -1044,6 +6521,50 @@ stack_overflow:
  */
 LUALIB_API int luaopen_voorhees(lua_State *L)
 {
+	const luaL_Reg *reg;
+	struct encoder *e;
+	int i;
+
+	/* Create the metatable of vectors */
+	luaL_newmetatable(L, VECTOR_MT);
+	for (reg = vector_methods; reg->name != NULL; reg++) {
+		lua_pushcfunction(L, reg->func);
+		lua_setfield(L, -2, reg->name);
+	}
+	lua_pop(L, 1);
+
+	/* Create the metatable of reader threads */
+	luaL_newmetatable(L, READER_MT);
+	lua_pushcfunction(L, reader_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* Create the metatable of snapshot mappings */
+	luaL_newmetatable(L, MAPPING_MT);
+	lua_pushcfunction(L, mapping_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* Create the metatable of encoder buffers */
+	luaL_newmetatable(L, ENCODER_MT);
+	lua_pushcfunction(L, encoder_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* Create the metatable of caches */
+	luaL_newmetatable(L, CACHE_MT);
+	lua_pushcfunction(L, cache_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* Create the metatable of shared cached documents */
+	luaL_newmetatable(L, READONLY_MT);
+	lua_pushcfunction(L, readonly_newindex);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushboolean(L, 0);
+	lua_setfield(L, -2, "__metatable");
+	lua_pop(L, 1);
+
 	/* Create new module table */
 	lua_newtable(L);
 
@@ -1052,7 +6573,70 @@ LUALIB_API int luaopen_voorhees(lua_State *L)
 	lua_pushvalue(L, 3);
 	lua_setfield(L, 2, "null");
 
-	/* Insert the decoder function */
+	/* Insert the decoder functions */
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, l_columns, 1);
+	lua_setfield(L, 2, "columns");
+
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, l_each, 1);
+	lua_setfield(L, 2, "each");
+
+	lua_pushvalue(L, 3);
+	lua_pushboolean(L, 0);
+	lua_pushcclosure(L, l_parse_into, 2);
+	lua_setfield(L, 2, "parse_into");
+
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, l_load, 1);
+	lua_setfield(L, 2, "load");
+
+	lua_pushcfunction(L, l_compile);
+	lua_setfield(L, 2, "compile");
+
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, l_transcode, 1);
+	lua_setfield(L, 2, "transcode");
+
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, l_parsefd, 1);
+	lua_setfield(L, 2, "parsefd");
+
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, l_cache, 1);
+	lua_setfield(L, 2, "cache");
+
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, l_decoder, 1);
+	lua_setfield(L, 2, "decoder");
+
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, l_compile_schema, 1);
+	lua_setfield(L, 2, "compile_schema");
+
+	/* Insert the encoder functions, which share the
+	 * buffer and the weak tables of frozen tables */
+	lua_pushvalue(L, 3);
+	e = lua_newuserdata(L, sizeof(struct encoder));
+	memset(e, 0, sizeof(struct encoder));
+	luaL_getmetatable(L, ENCODER_MT);
+	lua_setmetatable(L, -2);
+	for (i = 0; i < 2; i++) {
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+	}
+	lua_pushvalue(L, -4);
+	lua_pushvalue(L, -4);
+	lua_pushvalue(L, -4);
+	lua_pushvalue(L, -4);
+	lua_pushcclosure(L, l_freeze, 4);
+	lua_setfield(L, 2, "freeze");
+	lua_pushcclosure(L, l_encode, 4);
+	lua_setfield(L, 2, "encode");
+
 	lua_pushcclosure(L, l_parse, 1);
 	lua_setfield(L, 2, "parse");
 
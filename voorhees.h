@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2008 Emil Renner Berthing
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * The Software shall be used for Good, not Evil.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef VOORHEES_H
+#define VOORHEES_H
+
+#include <stddef.h>
+
+#ifndef VOORHEES_API
+#define VOORHEES_API extern
+#endif
+
+/*
+ * The plain C interface parses a JSON text into a tape.
+ *
+ * The tape is a flat array of 64 bit entries in document order.
+ * The low 3 bits of the tag holds the type of the entry and bit 3
+ * is set for strings which are stored verbatim in the source rather
+ * than in the string arena. The upper 28 bits of the tag holds the
+ * length in bytes of a string or the number of elements of an array
+ * or key/value pairs of an object.
+ *
+ * The meaning of data depends on the type:
+ *
+ *   null, false, true  unused
+ *   number             index into the numbers array
+ *   string             offset of the string in the arena, or in
+ *                      the source if VOORHEES_INSOURCE is set
+ *   array, object      index of the first entry after the last
+ *                      entry of the container
+ *
+ * An array entry is followed by the entries of its elements and
+ * an object entry is followed by a string entry for each key
+ * followed by the entries of its value. Strings in the arena are
+ * UTF-8 encoded and unescaped but not zero terminated.
+ */
+enum voorhees_type {
+	VOORHEES_NULL,
+	VOORHEES_FALSE,
+	VOORHEES_TRUE,
+	VOORHEES_NUMBER,
+	VOORHEES_STRING,
+	VOORHEES_ARRAY,
+	VOORHEES_OBJECT
+};
+
+#define VOORHEES_TYPEMASK 7
+#define VOORHEES_INSOURCE 8
+#define VOORHEES_SHIFT    4
+
+typedef struct voorhees_entry {
+	unsigned int tag;
+	unsigned int data;
+} voorhees_entry;
+
+/*
+ * Zero initialise this before the first call to voorhees_tape_parse().
+ * The same tape may be reused for many documents, in which case
+ * the memory allocated for the previous document is reused
+ */
+typedef struct voorhees_tape {
+	voorhees_entry *entries;
+	unsigned int nentries;
+	unsigned int entries_size;
+	double *numbers;
+	unsigned int nnumbers;
+	unsigned int numbers_size;
+	char *strings;
+	size_t nstrings;
+	size_t strings_size;
+	const char *source;
+	size_t read;
+} voorhees_tape;
+
+/*
+ * Error codes returned by voorhees_tape_parse()
+ */
+enum voorhees_error {
+	VOORHEES_OK,
+	VOORHEES_ESYNTAX,   /* syntax error after read bytes */
+	VOORHEES_EENCODING, /* encoding error after read bytes */
+	VOORHEES_EDEPTH,    /* stack overflow */
+	VOORHEES_ENOMEM,    /* out of memory */
+	VOORHEES_ETOOBIG    /* string, container or source too big */
+};
+
+/*
+ * Parse len bytes of source into the tape allowing depth levels of
+ * nested arrays and objects, or the default if depth is 0.
+ * The source must be kept alive as long as the tape is used
+ */
+VOORHEES_API int voorhees_tape_parse(voorhees_tape *t,
+		const char *source, size_t len, unsigned int depth);
+
+/*
+ * Free the memory used by the tape
+ */
+VOORHEES_API void voorhees_tape_free(voorhees_tape *t);
+
+#endif
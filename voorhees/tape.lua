@@ -0,0 +1,222 @@
+--[[
+LuaJIT FFI interface to the voorhees tape
+
+The document is parsed by voorhees_tape_parse() into a flat tape
+which is then walked from Lua without crossing the Lua C API,
+so the walk can be compiled by the JIT.
+
+   local tape = require 'voorhees.tape'
+
+   -- parse and build tables like voorhees.parse()
+   data = tape.decode('[{ "key" : "string" }, { "answer" : 42 }]')
+
+   -- or read fields directly from the tape
+   local t = assert(tape.parse(text))
+   local e = t:index(t:root(), 2)
+   print(t:value(t:field(e, 'answer')))
+--]]
+
+local ffi = require 'ffi'
+local bit = require 'bit'
+
+local band, rshift = bit.band, bit.rshift
+local ffi_string = ffi.string
+
+ffi.cdef [[
+typedef struct voorhees_entry {
+   unsigned int tag;
+   unsigned int data;
+} voorhees_entry;
+
+typedef struct voorhees_tape {
+   voorhees_entry *entries;
+   unsigned int nentries;
+   unsigned int entries_size;
+   double *numbers;
+   unsigned int nnumbers;
+   unsigned int numbers_size;
+   char *strings;
+   size_t nstrings;
+   size_t strings_size;
+   const char *source;
+   size_t read;
+} voorhees_tape;
+
+int voorhees_tape_parse(voorhees_tape *t,
+      const char *source, size_t len, unsigned int depth);
+void voorhees_tape_free(voorhees_tape *t);
+int memcmp(const void *s1, const void *s2, size_t n);
+]]
+
+local C = ffi.load(package.searchpath('voorhees', package.cpath))
+
+local NULL, FALSE, TRUE, NUMBER, STRING, ARRAY, OBJECT = 0, 1, 2, 3, 4, 5, 6
+local TYPEMASK, INSOURCE, SHIFT = 7, 8, 4
+
+local errors = {
+   'syntax error after %d bytes',
+   'encoding error after %d bytes',
+   'stack overflow',
+   'out of memory',
+   'document too big',
+}
+
+local new_table
+do
+   local ok, f = pcall(require, 'table.new')
+   new_table = ok and f or function() return {} end
+end
+
+local null
+do
+   local M = require 'voorhees'
+   null = M.null
+end
+
+local Tape = {}
+Tape.__index = Tape
+
+-- Types of entries as returned by Tape:type()
+Tape.NULL, Tape.FALSE, Tape.TRUE, Tape.NUMBER = NULL, FALSE, TRUE, NUMBER
+Tape.STRING, Tape.ARRAY, Tape.OBJECT = STRING, ARRAY, OBJECT
+
+-- Index of the root array or object
+function Tape:root()
+   return 0
+end
+
+function Tape:type(i)
+   return band(self.entries[i].tag, TYPEMASK)
+end
+
+-- Number of elements of an array or key/value pairs of an object
+function Tape:count(i)
+   return rshift(self.entries[i].tag, SHIFT)
+end
+
+-- Index of the entry following the value at i
+function Tape:skip(i)
+   local e = self.entries[i]
+   local t = band(e.tag, TYPEMASK)
+   if t == ARRAY or t == OBJECT then
+      return e.data
+   end
+   return i + 1
+end
+
+-- Pointer to and length of the string at i
+function Tape:pointer(i)
+   local e = self.entries[i]
+   local base = band(e.tag, INSOURCE) ~= 0 and self.source or self.strings
+   return base + e.data, rshift(e.tag, SHIFT)
+end
+
+-- Value of the null, boolean, number or string at i
+function Tape:value(i)
+   local e = self.entries[i]
+   local t = band(e.tag, TYPEMASK)
+   if t == STRING then
+      return ffi_string(self:pointer(i))
+   elseif t == NUMBER then
+      return self.numbers[e.data]
+   elseif t == TRUE then
+      return true
+   elseif t == FALSE then
+      return false
+   end
+   return self.null
+end
+
+-- Index of the n'th (1-based) element of the array at i or nil
+function Tape:index(i, n)
+   if n < 1 or n > self:count(i) then return nil end
+   i = i + 1
+   for _ = 2, n do
+      i = self:skip(i)
+   end
+   return i
+end
+
+-- Index of the value of key in the object at i or nil
+function Tape:field(i, key)
+   local len = #key
+   i = i + 1
+   for _ = 1, self:count(i - 1) do
+      local p, l = self:pointer(i)
+      if l == len and C.memcmp(p, key, len) == 0 then
+         return i + 1
+      end
+      i = self:skip(i + 1)
+   end
+   return nil
+end
+
+local function materialize(self, i)
+   local e = self.entries[i]
+   local t = band(e.tag, TYPEMASK)
+   local n = rshift(e.tag, SHIFT)
+
+   if t == ARRAY then
+      local a = new_table(n, 0)
+      i = i + 1
+      for k = 1, n do
+         a[k], i = materialize(self, i)
+      end
+      return a, e.data
+   elseif t == OBJECT then
+      local o = new_table(0, n)
+      i = i + 1
+      for _ = 1, n do
+         local k = ffi_string(self:pointer(i))
+         o[k], i = materialize(self, i + 1)
+      end
+      return o, e.data
+   end
+
+   return self:value(i), i + 1
+end
+
+-- Build Lua tables from the value at i (the root by default)
+function Tape:materialize(i)
+   return (materialize(self, i or 0))
+end
+
+local function new(t, source, nullv)
+   return setmetatable({
+      tape = t,
+      source = ffi.cast('const char *', source),
+      anchor = source,
+      entries = t.entries,
+      numbers = t.numbers,
+      strings = t.strings,
+      null = nullv == nil and null or nullv,
+   }, Tape)
+end
+
+local M = {}
+
+--[[
+Parse the string source to a new tape object.
+Returns nil followed by an error message on errors
+--]]
+function M.parse(source, depth, nullv)
+   local t = ffi.gc(ffi.new('voorhees_tape'), C.voorhees_tape_free)
+   local err = C.voorhees_tape_parse(t, source, #source, depth or 0)
+   if err ~= 0 then
+      return nil, errors[err]:format(tonumber(t.read))
+   end
+   return new(t, source, nullv)
+end
+
+--[[
+Same as voorhees.parse(source, 'utf8', depth, null) but using the tape
+--]]
+function M.decode(source, depth, nullv)
+   local t, msg = M.parse(source, depth, nullv)
+   if not t then return nil, msg end
+   return t:materialize()
+end
+
+return M
+
+-- vi: syntax=lua ts=3 sw=3 et: